@@ -18,6 +18,9 @@
 //
 ////////////////////////////////////////////////////////////////////////////////
 // headers
+#define _XOPEN_SOURCE 700	// POSIX.1-2008 calls even under the Makefile's -std=c99,
+#define _DEFAULT_SOURCE		// plus mmap's MAP_FILE and MAP_ANONYMOUS on glibc
+#define _DARWIN_C_SOURCE	// and on OS X
 #include "SDL.h"
 #include "SDL_opengl.h"
 #include "SDL_image.h"
@@ -35,6 +38,10 @@
 #include <net/if.h>
 #include <sys/ioctl.h>
 #include <pcap.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <sys/un.h>
+#include <poll.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 // errors
@@ -47,14 +54,31 @@
 #define NO_NET_DEVICE	7
 #define NO_NET_ADDR	8
 #define NO_CAPTURE	9
+#define NO_TRACE	10
+#define NO_CHUNK	11
+#define NO_TELEMETRY	12
+#define NO_PROFILE	13
+#define NO_SAVE		14
 
 ////////////////////////////////////////////////////////////////////////////////
 // sizes
 #define CACHE_SIZE	4096
+#define ICACHE_LINES	256		// Lines in each core's instruction cache
+#define ICACHE_LINE	16		// Cells in each line of the instruction cache
 #define ROM_SIZE	4096
 #define RAM_SIZE	268435456
 #define FLASH_SIZE	268435456
 #define NET_SIZE	4096
+#define CORES		16
+#define MAILBOX_SIZE	256
+#define SLICE_SIZE	1000000
+#define BATCH_TICKS	100000000
+#define PROFILE_SIZE	4096
+#define PROFILE_STACKS	16384
+#define AUDIO_WATERMARK	1024		// Samples left playing when a core is told to refill
+#define INPUT_SIZE	256		// Events the input ring holds
+#define FRAME_BUCKETS	7		// Buckets of the frame time histogram
+#define MISSED_BUCKETS	6		// Buckets of the missed frame histogram
 
 ////////////////////////////////////////////////////////////////////////////////
 // timings
@@ -62,27 +86,99 @@
 #define INTERRUPT_RATE	1000	
 #define NETWORK_RATE	100
 
+////////////////////////////////////////////////////////////////////////////////
+// trace records
+#define TRACE_MAGIC	0x5254534e	// "NSTR"
+#define TRACE_KEY	1
+#define TRACE_MOUSE	2
+#define TRACE_PACKET	3
+#define TRACE_END	4
+#define TRACE_INPUT	5
+
+////////////////////////////////////////////////////////////////////////////////
+// input events, as read from the ring
+#define INPUT_KEY	1		// key code, 0x80 set while down
+#define INPUT_MOTION	2		// x, y
+#define INPUT_BUTTON	3		// button bit, 0x80 set while down
+
 ////////////////////////////////////////////////////////////////////////////////
 // typedefs
 typedef Uint32 cell;	// 32bit unsigned integer 
 typedef void (*device_fo)(cell);
 typedef cell (*device_fi)();
 
+#include "nsi.h"		// The image format, shared with nsc
+
 ////////////////////////////////////////////////////////////////////////////////
 // VM globals
-cell ip;		// Instruction Pointer
-cell dsi;		// Data Stack Index
-cell ds[8];		// Data Stack
-cell rsi;		// Return Stack Index
-cell rs[8];		// Return STack
-cell cnt;		// Count Register
-cell src;		// Source Register
-cell dst;		// Destination Register
-cell utl;		// Utility / Status Register
-cell im[CACHE_SIZE];	// Instruction Memory (modified Havard Architecture)
+typedef struct {
+	cell ip;		// Instruction Pointer
+	cell dsi;		// Data Stack Index
+	cell ds[8];		// Data Stack
+	cell rsi;		// Return Stack Index
+	cell rs[8];		// Return STack
+	cell cnt;		// Count Register
+	cell src;		// Source Register
+	cell dst;		// Destination Register
+	cell utl;		// Utility / Status Register
+	cell id;		// Core ID Register
+	cell ticks;		// Core clock
+	unsigned long long moved;	// Bytes copied by the DMA opcodes
+	cell idle;		// Ticks the core spent waiting
+	cell waiting;		// Events the core is waiting for, 0 while it runs
+	cell alarm;		// Tick the timer fires on, 0 when it is disarmed
+	cell* ms;		// Memory Source
+	cell* md;		// Memory Destination
+	cell* ram;		// RAM this core is wired to
+	cell* flash;		// Flash image this core is wired to
+	cell flash_cells;	// Cells of it mapped
+	cell* rom;		// ROM this core is wired to
+	cell slice;		// Ticks left in this time slice plus one, 0 runs forever
+	cell output;		// Signature of everything written to headless devices
+	cell writes;		// Number of writes to headless devices
+	cell key_buffer;	// Last Key Event data buffer
+	cell mouse_buffer[3];	// Last Mouse Event data buffer
+	cell mouse_buffer_index;	// Index into Mouse Buffer (3 cycle read)
+	cell input[INPUT_SIZE][4];	// Ring of input events: tick, kind, and two cells of data
+	cell input_head;	// Index of the next event to read
+	cell input_tail;	// Index of the next free event slot
+	cell input_cell;	// Cell of the head event to read next
+	cell input_dropped;	// Events lost to a full ring since the status was read
+	cell input_queued;	// Set when the guest reads the ring rather than the buffers
+	cell net_read_buffer[NET_SIZE];	// an input buffer for incoming packets
+	cell net_read_index;	// an index into the read buffer
+	cell net_read_len;	// the number of bytes read last read
+	FILE* trace;		// Event trace being recorded or replayed
+	cell replay;		// Set when the trace is replayed rather than recorded
+	cell trace_tick;	// Tick of the next record to replay
+	cell trace_kind;	// Kind of the next record to replay
+	cell trace_len;		// Length in bytes of the next record's payload
+	cell trace_data[NET_SIZE];	// Payload of the next record to replay
+	cell halted;		// Set once a replayed trace has ended
+	cell mailbox[MAILBOX_SIZE];	// Incoming messages from other cores
+	cell mailbox_head;		// Index of the next message to read
+	cell mailbox_tail;		// Index of the next free message slot
+	SDL_mutex* mailbox_lock;	// Guards the mailbox against concurrent senders
+	cell mailbox_command[2];	// Outgoing message buffer, 0 core 1 data
+	cell mailbox_index;		// Outgoing message buffer index
+	SDL_Thread* thread;		// Host thread simulating this core
+	cell im[CACHE_SIZE];	// Instruction Memory (modified Havard Architecture)
+	cell icache_tag[ICACHE_LINES];	// Address of the line in each slot, 0 when empty
+	cell icache[ICACHE_LINES][ICACHE_LINE];	// Lines of RAM and flash being executed
+	unsigned long long icache_hits;	// Fetches from RAM and flash found in the cache
+	unsigned long long icache_misses;	// Fetches that filled a line from RAM or flash
+	unsigned long long icache_invalidations;	// Lines dropped because their memory was written
+	cell icache_live;	// Set on core 0 once any core of its machine has run code outside IM
+} core;
+
+core cores[CORES];	// Guest cores, each with its own registers, stacks, and IM
+cell core_count = 1;	// Number of guest cores booted
+__thread core* cpu;	// Core simulated by the current host thread
 cell rom[ROM_SIZE];	// Read Only Memory (first 16k of Flash Image)
-cell* ram;		// RAM pointer	(1GB)
-cell* flash;		// FLASH Image pointer
+cell* ram;		// RAM pointer	(1GB)  shared by all cores
+cell* flash;		// FLASH Image pointer shared by all cores
+cell headless = 0;	// Set when running batch instances without SDL devices
+unsigned long long icache_totals[3];	// Cache hits, misses, and invalidations reported
 
 ////////////////////////////////////////////////////////////////////////////////
 // System globals
@@ -93,42 +189,357 @@ SDL_Surface* display;	// Display Device
 SDL_Event event;	// Last Event Polled
 cell samples = 0;	// Clock rate samples
 cell rate = 0;		// floating rate average
-cell ticks;		// System clock
 cell period;		// Ticks per frame refresh
 cell last;		// Last Frame in ms
 cell now;		// Current Time in ms
-cell* ms;		// Memory Source
-cell* md;		// Memory Destination
+volatile cell running = 1;	// Cleared to stop all cores
+char* telemetry_path = NULL;	// UNIX socket the counters are served on, set by -t
+cell telemetry_made = 0;	// Set once this run has made the socket, and so removes it
+
+////////////////////////////////////////////////////////////////////////////////
+// Telemetry counters, each written by a single thread, core 0's unless noted,
+// and read without locks by the telemetry thread
+cell frame_limits[FRAME_BUCKETS - 1] = { 42, 50, 67, 100, 250, 1000 };	// in ms
+cell missed_limits[MISSED_BUCKETS - 1] = { 0, 1, 2, 4, 8 };
+unsigned long long frame_hist[FRAME_BUCKETS];	// Frames by the time they took
+unsigned long long missed_hist[MISSED_BUCKETS];	// Frames by how many they overran
+unsigned long long frames = 0;		// Frames drawn by update()
+unsigned long long frame_ms = 0;	// Time taken by all those frames
+unsigned long long frames_missed = 0;	// Frame periods passed without an update
+unsigned long long vid_commands = 0;	// VGDD commands run
+cell vid_frame_commands = 0;		// VGDD commands run this frame
+cell vid_last_commands = 0;		// VGDD commands run last frame
+unsigned long long audio_underruns = 0;	// Callbacks short of audio, by the SDL audio thread
+unsigned long long packets_received = 0;
+unsigned long long packets_sent = 0;
+unsigned long long packets_dropped = 0;	// Received before the last was read, or failed to send
 
 ////////////////////////////////////////////////////////////////////////////////
 // vm functions
 INLINE void nop() { return; }
-INLINE cell tos() { return ds[dsi]; }			// Top of Stack
-INLINE cell nos() { return ds[7&(dsi-1)]; }		// Next on Stack
-INLINE void up(cell c) { ds[dsi = 7&(dsi+1)] = c; }	// Push c onto Data Stack
-INLINE void down() { dsi = 7&(dsi-1); }			// Drop Top of Stack
-INLINE void stos(cell c) { ds[dsi] = c; }		// Store Top of Stack
-INLINE void snos(cell c) { ds[7&(dsi-1)] = c; }		// Store Next on Stack
-INLINE cell rtos() { return rs[rsi]; }			// Return Stack Top of Stack
-INLINE void upr(cell c) { rs[rsi = 7&(rsi+1)] = c; }	// Push c onto Return Stack
-INLINE void downr() { rsi = 7&(rsi-1); }		// Drop Top of Return Stack
+INLINE cell tos() { return cpu->ds[cpu->dsi]; }				// Top of Stack
+INLINE cell nos() { return cpu->ds[7&(cpu->dsi-1)]; }			// Next on Stack
+INLINE void up(cell c) { cpu->ds[cpu->dsi = 7&(cpu->dsi+1)] = c; }	// Push c onto Data Stack
+INLINE void down() { cpu->dsi = 7&(cpu->dsi-1); }			// Drop Top of Stack
+INLINE void stos(cell c) { cpu->ds[cpu->dsi] = c; }			// Store Top of Stack
+INLINE void snos(cell c) { cpu->ds[7&(cpu->dsi-1)] = c; }		// Store Next on Stack
+INLINE cell rtos() { return cpu->rs[cpu->rsi]; }			// Return Stack Top of Stack
+INLINE void upr(cell c) { cpu->rs[cpu->rsi = 7&(cpu->rsi+1)] = c; }	// Push c onto Return Stack
+INLINE void downr() { cpu->rsi = 7&(cpu->rsi-1); }			// Drop Top of Return Stack
+INLINE core* master() { return cpu - cpu->id; }		// Core 0 of this machine, which owns the devices
+#define ANY_EVENT 0x1f3	// Every event a core can wait on: keys, the mouse, messages, packets,
+			// the audio watermark, frames, and the timer
+INLINE void notify(cell bits) {						// Raise events in the utility
+	cpu->utl |= bits;						// register, and wake the core
+	if (cpu->waiting & bits) cpu->waiting = 0;			// if it was waiting on them
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// input functions
+void input_push(cell* e) {			// Add an event to the core's input ring.  An
+	if (cpu->input_tail - cpu->input_head >= INPUT_SIZE) {	// event arriving at a full
+		++cpu->input_dropped;		// ring is counted and dropped, so the guest
+		return;				// sees the oldest events, and knows it missed
+	}					// some.
+	memcpy(cpu->input[cpu->input_tail++ % INPUT_SIZE],e,4 * sizeof(cell));
+}
+
+void input_deliver() {				// Raise the pending input on each interrupt.
+	if (cpu->input_queued) {		// A guest reading the ring sees bit 0 while
+		for (cell i = cpu->input_head; i != cpu->input_tail; ++i)	// keys are waiting,
+			notify(cpu->input[i % INPUT_SIZE][1] == INPUT_KEY ? 1 : 2);	// and bit 1
+		return;				// for the mouse.  Otherwise events are moved
+	}					// into the key and mouse buffers, a key or
+	while (cpu->input_head != cpu->input_tail) {	// button per interrupt, with all the
+		cell* e = cpu->input[cpu->input_head++ % INPUT_SIZE];	// motion before it
+		if (e[1] == INPUT_MOTION) {	// folded into the last position.
+			cpu->mouse_buffer[0] = e[2];
+			cpu->mouse_buffer[1] = e[3];
+			notify(2);
+			continue;
+		}
+		if (e[1] == INPUT_KEY) {
+			cpu->key_buffer = e[2];
+			notify(1);
+		} else {
+			cpu->mouse_buffer[2] = e[2];
+			notify(2);
+		}
+		return;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// trace functions
+void record(cell kind, void* data, cell len) {		// Append a delivered event to the trace
+	cell head[3] = { cpu->ticks, kind, len };	// Each record holds the tick the event 
+	cell pad = 0;					// was delivered on, its kind, and the
+	if (!cpu->trace || cpu->replay) return;		// length of its payload in bytes,
+	fwrite(head,sizeof(cell),3,cpu->trace);		// padded to whole cells in the file.
+	fwrite(data,1,len,cpu->trace);
+	fwrite(&pad,1,-len & 3,cpu->trace);
+}
+
+void trace_read(core* c) {				// Read the next record to replay
+	cell head[3];					// A truncated trace ends as if it
+	cell cells;					// had been closed, and payloads too
+	if (fread(head,sizeof(cell),3,c->trace) != 3) {	// big for the buffer are cut short.
+		c->trace_kind = TRACE_END;
+		return;
+	}
+	c->trace_tick = head[0];
+	c->trace_kind = head[1];
+	cells = (head[2] + 3) / sizeof(cell);
+	c->trace_len = cells > NET_SIZE ? sizeof(c->trace_data) : head[2];
+	fread(c->trace_data,sizeof(cell),cells > NET_SIZE ? NET_SIZE : cells,c->trace);
+	if (cells > NET_SIZE) fseek(c->trace,(cells - NET_SIZE) * sizeof(cell),SEEK_CUR);
+}
+
+void trace_open(core* c, char* file, cell replay) {	// Start recording or replaying a trace
+	cell magic = TRACE_MAGIC;			// of the events delivered to core c.
+	c->trace = fopen(file,replay ? "rb" : "wb");
+	if (!c->trace) exit(NO_TRACE);
+	c->replay = replay;
+	if (!replay) { fwrite(&magic,sizeof(cell),1,c->trace); return; }
+	if (fread(&magic,sizeof(cell),1,c->trace) != 1 || magic != TRACE_MAGIC) exit(NO_TRACE);
+	trace_read(c);
+}
+
+cell replay(cell net) {				// Apply the record due by this tick, if any,
+	cell kind = cpu->trace_kind;		// returning 1 if there was one.  The device
+	if (cpu->trace_tick > cpu->ticks && !feof(cpu->trace)) return 0;	// interrupt
+	if ((kind == TRACE_PACKET) != net) return 0;	// calls until every input event due
+	switch (kind) {				// is queued, the network interrupt takes one
+		case TRACE_INPUT:		// packet.  Key and mouse records are from
+			input_push(cpu->trace_data);	// traces made before the input ring.
+			break;
+		case TRACE_KEY:
+			notify(1);
+			cpu->key_buffer = cpu->trace_data[0];
+			break;
+		case TRACE_MOUSE:
+			notify(2);
+			memcpy(cpu->mouse_buffer,cpu->trace_data,sizeof(cpu->mouse_buffer));
+			break;
+		case TRACE_PACKET:
+			memcpy(cpu->net_read_buffer,cpu->trace_data,cpu->trace_len);
+			cpu->net_read_index = 0;
+			cpu->net_read_len = cpu->trace_len;
+			notify(0x20);
+			break;
+		default:			// The end of the trace halts the machine
+			cpu->halted = 1;
+			return 0;
+	}
+	trace_read(cpu);
+	return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// profiling functions
+typedef struct {
+	cell addr;		// IM address of a method
+	char name[36];		// Object.method
+} symbol;
+
+typedef struct {
+	cell seq;		// Sample number + 1, set once the sample is complete
+	cell ip;		// Instruction pointer when the sample was taken
+	cell rsi;		// Return stack index
+	cell rs[8];		// Return stack
+} sample;
+
+typedef struct {
+	cell count;		// Times this stack was sampled
+	cell depth;		// Number of frames, outermost first
+	cell frames[9];		// Method addresses, or the raw ip if it isn't in a method
+} stack;
+
+// This character map translates the Firth character set in the image's strings back to ASCII
+char char_map[] = "0123456789abcdefghijklmnopqrstuvwxyz,./;'[]\\`-= )!@#$%^&*(ABCDEFGHIJKLMNOPQRSTUVWXYZ<>?:\"{}|~_+\t\n";
+
+symbol* symbols = NULL;			// Methods found in the image's lexicon, by address
+cell symbol_count = 0;
+cell symbol_end = 0;			// Bottom of the lexicon, where the last method ends
+cell profile_rate = 0;			// Samples per second, 0 when not profiling
+sample profile_ring[PROFILE_SIZE];	// Samples waiting to be folded into stacks
+volatile cell profile_head = 0;		// Next sample to be written by the timer signal
+cell profile_tail = 0;			// Next sample to be folded
+stack profile_stacks[PROFILE_STACKS];	// Folded stacks, hashed by their frames
+cell profile_count = 0;			// Samples folded
+cell profile_dropped = 0;		// Samples lost to a full ring or stack table
+
+void symbol_name(cell* image, cell str, char* out, char* end) {	// Translate an image string
+	for (cell i = 0; i < 4; ++i)		// to ASCII.  Characters are stored MSB
+		for (int s = 24; s >= 0; s -= 8) {	// first, and padded with #ff.
+			cell c = (image[str+i] >> s) & 0xff;
+			if (c < sizeof(char_map) - 1 && out < end)
+				*out++ = char_map[c] == ';' ? '_' : char_map[c];	// ; separates frames
+		}
+	*out = '\0';
+}
+
+cell lexicon_walk(cell* image, cell i) {	// Each object in the lexicon is a name, a count,
+	while (i < LEXICON_OFFSET && image[i+1] < (LEXICON_OFFSET - i) / 2)	// and count name/address
+		i += 2 * image[i+1] + 2;		// pairs.  A walk from the bottom of the
+	return i;				// lexicon lands exactly on LEXICON_OFFSET.
+}
+
+int symbol_compare(const void* a, const void* b) {
+	return ((symbol*)a)->addr < ((symbol*)b)->addr ? -1 : ((symbol*)a)->addr > ((symbol*)b)->addr;
+}
+
+void symbols_load(cell* image, cell size) {	// Build the symbol table from the lexicon.
+	cell base, i, n = 0;			// nsc doesn't record where the lexicon starts,
+	char object[17];			// but it never holds two zero cells in a row, so we
+	if (size < STRINGS_OFFSET * sizeof(cell)) return;	// search down for a gap, then up for
+	for (base = LEXICON_OFFSET - 1; base > 1 && (image[base] || image[base-1]); --base);
+	while (base < LEXICON_OFFSET && lexicon_walk(image,base) != LEXICON_OFFSET) ++base;	// a walk
+	for (i = base; i < LEXICON_OFFSET; i += 2 * image[i+1] + 2) n += image[i+1];	// that fits.
+	symbols = calloc(n + 1,sizeof(symbol));
+	for (i = base; i < LEXICON_OFFSET; i += 2 * image[i+1] + 2) {
+		if (i + 2 * image[i+1] + 2 == LEXICON_OFFSET) break;	// The Core object holds opcodes
+		symbol_name(image,image[i],object,object + 16);
+		for (cell j = 0; j < image[i+1]; ++j) {
+			symbol* s = &symbols[symbol_count++];
+			s->addr = image[i + 3 + 2*j];
+			strcpy(s->name,object);
+			strcat(s->name,".");
+			symbol_name(image,image[i + 2 + 2*j],s->name + strlen(s->name),s->name + sizeof(s->name) - 1);
+		}
+	}
+	qsort(symbols,symbol_count,sizeof(symbol),symbol_compare);
+	symbol_end = base;		// Code is compiled up to the lexicon
+}
+
+symbol* symbol_at(cell addr) {			// Find the method containing a code address
+	cell lo = 0, hi = symbol_count;		// by binary search, methods run until the
+	addr &= 0x7fffffff;			// next one starts or the lexicon.
+	if (addr >= symbol_end) return NULL;	// The lexicon's addresses are offsets into
+						// the image, which IM mirrors the start of,
+						// so flash is looked up by its offset, and
+						// RAM as is, for code copied out of flash.
+	while (lo < hi) {
+		cell mid = (lo + hi) / 2;
+		if (symbols[mid].addr <= addr) lo = mid + 1; else hi = mid;
+	}
+	return lo ? &symbols[lo-1] : NULL;
+}
+
+void profile_sample(int sig) {			// SIGPROF handler.  It runs on whichever host
+	core* c = cpu;				// thread the timer interrupted, and copies that
+	sample* s;				// core's ip and return stack into the ring.
+	cell n;
+	if (!c) return;
+	n = __sync_fetch_and_add(&profile_head,1);
+	s = &profile_ring[n % PROFILE_SIZE];
+	s->ip = c->ip;
+	s->rsi = c->rsi;
+	memcpy(s->rs,c->rs,sizeof(s->rs));
+	__sync_synchronize();
+	s->seq = n + 1;
+}
+
+void profile_fold(stack* k) {			// Count a stack in the stack table
+	cell h = 2166136261u;
+	for (cell i = 0; i < k->depth; ++i) h = (h ^ k->frames[i]) * 16777619;
+	for (cell i = 0; i < PROFILE_STACKS; ++i) {
+		stack* e = &profile_stacks[(h + i) % PROFILE_STACKS];
+		if (!e->count) {		// A new stack starts with its first
+			*e = *k;		// sample counted
+			++profile_count;
+			return;
+		}
+		if (e->depth == k->depth && !memcmp(e->frames,k->frames,k->depth*sizeof(cell))) {
+			++e->count;
+			++profile_count;
+			return;
+		}
+	}
+	++profile_dropped;
+}
+
+void profile_drain() {				// Fold the samples taken since the last drain.
+	symbol* s;				// Called from one thread only.  The return stack
+	if (profile_head - profile_tail > PROFILE_SIZE) {	// is shallow, circular, and shared
+		profile_dropped += profile_head - profile_tail - PROFILE_SIZE;	// with >r, so its
+		profile_tail = profile_head - PROFILE_SIZE;	// frames are best effort, we keep
+	}						// the ones that land in a method.
+	while (profile_tail != profile_head) {
+		sample* p = &profile_ring[profile_tail % PROFILE_SIZE];
+		stack k = { 1, 0 };
+		if (p->seq != profile_tail + 1) return;	// still being written
+		for (cell i = 1; i <= 8; ++i)
+			if ((s = symbol_at(p->rs[(p->rsi + i) & 7] - 1))) k.frames[k.depth++] = s->addr;
+		k.frames[k.depth++] = (s = symbol_at(p->ip - 1)) ? s->addr : p->ip - 1;
+		profile_fold(&k);
+		++profile_tail;
+	}
+}
+
+void profile_start(cell* image, cell size) {	// Load the image's symbols, write them out as
+	char file[64];				// a perf style map of image offsets, and start
+	FILE* f;				// sampling with a profiling timer.
+	struct sigaction sa;
+	cell period = 1000000 / profile_rate;	// in microseconds
+	struct itimerval it = { { period / 1000000, period % 1000000 }, { period / 1000000, period % 1000000 } };
+	symbols_load(image,size);
+	sprintf(file,"/tmp/ns-%d.map",getpid());
+	if ((f = fopen(file,"w"))) {
+		for (cell i = 0; i < symbol_count; ++i)
+			fprintf(f,"%x %x %s\n",symbols[i].addr,
+				(i + 1 < symbol_count ? symbols[i+1].addr : symbol_end) - symbols[i].addr,symbols[i].name);
+		fclose(f);
+	}
+	memset(&sa,0,sizeof(sa));
+	sa.sa_handler = profile_sample;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGPROF,&sa,NULL);
+	if (setitimer(ITIMER_PROF,&it,NULL)) exit(NO_PROFILE);
+}
+
+void profile_write() {				// Write the folded stacks for flamegraph.pl
+	char file[64];
+	FILE* f;
+	symbol* s;
+	profile_drain();
+	sprintf(file,"/tmp/ns-%d.folded",getpid());
+	if (!(f = fopen(file,"w"))) return;
+	for (cell i = 0; i < PROFILE_STACKS; ++i) {
+		stack* k = &profile_stacks[i];
+		if (!k->count) continue;
+		for (cell j = 0; j < k->depth; ++j)
+			(s = symbol_at(k->frames[j])) && s->addr == k->frames[j] ?
+				fprintf(f,"%s%s",j ? ";" : "",s->name) :
+				fprintf(f,"%s%x",j ? ";" : "",k->frames[j]);
+		fprintf(f," %u\n",k->count);
+	}
+	fclose(f);
+	fprintf(stderr,"Profile: %u samples, %u dropped, %s\n",profile_count,profile_dropped,file);
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 // memory address translation functions
 void source() {					// Switch between
-	ms = src & 0x80000000 ? &flash[src & 0x7fffffff]:	// VM addressing 
-		src < 0x1000 ? &rom[src] :			// and C style native
-		src < 0x7ffffff9 ? &ram[src] :			// addressing for
+	cpu->ms = cpu->src & 0x80000000 ? &cpu->flash[cpu->src & 0x7fffffff]:	// VM addressing 
+		cpu->src < 0x1000 ? &cpu->rom[cpu->src] :	// and C style native
+		cpu->src < 0x7ffffff9 ? &cpu->ram[cpu->src] :	// addressing for
 		NULL;						// NUMA architecture.
 }								// These functions
 								// map flash memory
 void destination() {				// address 0x80000000+
-	md = dst & 0x80000000 ? &flash[dst] :			// to the memory image
-		dst < 0x1000 ? &im[dst] :			// and addresses < 0x1000
-		dst < 0x7ffffff9 ? &ram[dst] :			// to ROM or IM with all
+	cpu->md = cpu->dst & 0x80000000 ? &cpu->flash[cpu->dst] :	// to the memory image
+		cpu->dst < 0x1000 ? &cpu->im[cpu->dst] :	// and addresses < 0x1000
+		cpu->dst < 0x7ffffff9 ? &cpu->ram[cpu->dst] :	// to ROM or IM with all
 		NULL;						// others going to RAM
 }								// I/O devices -> NULL
 
+cell* shared(cell addr) {			// Host address of a cell in memory shared
+	return addr & 0x80000000 ? &cpu->flash[addr & 0x7fffffff] :	// between cores, flash and RAM.
+		addr >= 0x1000 && addr < 0x7ffffff9 ? &cpu->ram[addr] :	// ROM, IM, and devices are
+		NULL;						// private and can't be used
+}								// with the atomic opcodes.
+
 ////////////////////////////////////////////////////////////////////////////////
 // network functions
 
@@ -137,10 +548,6 @@ cell net_addr = 0;			// our network address, eg. 192.168.1.1
 cell net_mask = 0;			// our netmask, eg. 255.255.255.0
 pcap_t* net_capture = NULL;		// a handle to the packet capture device
 
-cell net_read_buffer[NET_SIZE];		// an input buffer for incoming packets
-cell net_read_index = 0;		// an index into the read buffer
-cell net_read_len = 0;			// the number of bytes read last read
-
 cell net_write_buffer[NET_SIZE];	// an output buffer for outgoing packets
 cell net_write_index = 0;		// an index into the write buffer
 
@@ -149,24 +556,32 @@ void net_read_callback() {
 	const Uint8* packet = pcap_next(net_capture,&hdr);	// packet available
 	if (!packet) return;					// and copy as many
 	fprintf(stderr,"Got packet of %d bytes\n",hdr.len);	// bytes to the read
-	memcpy(net_read_buffer,packet,hdr.caplen);		// buffer as we can
-	net_read_index = 0;					// and then reset the
-	net_read_len = hdr.caplen;				// read index / length
+	++packets_received;					// buffer as we can,
+	if (cpu->net_read_index * sizeof(cell) < cpu->net_read_len) ++packets_dropped;	// over
+	memcpy(cpu->net_read_buffer,packet,hdr.caplen);		// any left unread,
+	cpu->net_read_index = 0;				// and then reset the
+	cpu->net_read_len = hdr.caplen;				// read index / length
+	record(TRACE_PACKET,cpu->net_read_buffer,hdr.caplen);	// logging it if recording
+	notify(0x20);						// and raising bit 5
 }
 
 cell net_read() {					// Read from Network Interface
-	if (net_read_index >= net_read_len) return 0;	// read_len is amount read
-	return net_read_buffer[net_read_index++];	// reads one cell at a time
+	core* m = master();				// The NIC is wired to core 0
+	if (m->net_read_index >= m->net_read_len) return 0;	// read_len is amount read
+	return m->net_read_buffer[m->net_read_index++];	// reads one cell at a time
 }							// callback will reset on us!
 
 void net_write_callback() {				// Writes the full output buffer
 	if (net_write_index == 0) return;
-	if (0>pcap_inject(net_capture,net_write_buffer,net_write_index))
+	if (0>pcap_inject(net_capture,net_write_buffer,net_write_index)) {
 		pcap_perror(net_capture,"Write Error: ");
+		++packets_dropped;
+	} else ++packets_sent;
 	net_write_index = 0;				// And resets the write index
 }
 
 void net_write(cell val) {				// Write to Network Interface
+	if (cpu->id) return;				// The NIC is wired to core 0 only
 	net_write_index %= NET_SIZE;			// one cell at a time, and loops
 	net_write_buffer[net_write_index++] = val;	// if we write more than fits 
 }							// within the write buffer!
@@ -191,28 +606,52 @@ void network_init() {			// To initialize the network we need to gain root access
 	if (! (net_capture = pcap_open_live(net_device,NET_SIZE,0,1,err))) // Other times because 
 		net_error(NO_CAPTURE);	// We have no address for the NIC.  But when we're done
 	seteuid(id);			// we restore the effective privs to user level ones, and
-	net_read_callback();		// attempt to use the device to ensure we can still read packets.
-}
+	if (!cpu->replay) net_read_callback();	// attempt to use the device to ensure we can
+}					// still read packets, unless replaying a trace.
 
 void net_interrupt() {
-	if (!net_capture) return;
+	if (cpu->id) return;
+	if (cpu->replay) replay(1);			// Replayed packets stand in for the NIC, and
+	if (!net_capture || cpu->replay) return;	// nothing is sent during a replay
 	net_read_callback();
 	net_write_callback();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 // mouse functions
-cell mouse_buffer[3] = { 0, 0, 0 };		// Last Mouse Event data buffer
-cell mouse_buffer_index = 0;			// Index into Mouse Buffer (3 cycle read)
 cell mouse_read() {				// Read one cell from mouse buffer, cyclic
-	mouse_buffer_index %= 3;
-	return mouse_buffer[mouse_buffer_index++];
+	core* m = master();			// The mouse is wired to core 0.  Once the
+	cell status;				// guest reads the input ring this port
+	if (m->input_queued) {			// reads its status instead: the events
+		if (cpu != m) return 0;		// waiting, and those dropped since the
+		status = (m->input_tail - m->input_head) |	// last read in the top 16 bits.
+			(m->input_dropped > 0xffff ? 0xffff : m->input_dropped) << 16;
+		m->input_dropped = 0;
+		return status;
+	}
+	m->mouse_buffer_index %= 3;
+	return m->mouse_buffer[m->mouse_buffer_index++];
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 // keyboard functions
-cell key_buffer = 0;				// Last Key Event data buffer
-cell key_read() { return key_buffer; }		// Read one cell from last key buffer
+cell key_read() {				// Read one cell from last key buffer, or
+	core* m = master();			// the next cell of the input ring once the
+	cell val;				// guest has switched to it.  The ring is
+	if (!m->input_queued) return m->key_buffer;	// read by core 0 only, a cell
+	if (cpu != m || m->input_head == m->input_tail) return 0;	// at a time, 0 once
+	val = m->input[m->input_head % INPUT_SIZE][m->input_cell++];	// it is empty.
+	if (m->input_cell == 4) {
+		m->input_cell = 0;
+		++m->input_head;
+	}
+	return val;
+}
+
+void key_write(cell val) {			// Writing 1 to the key port switches the
+	master()->input_queued = val != 0;	// machine's input to the ring, and 0 back
+	master()->input_cell = 0;		// to the key and mouse buffers.
+}
 
 cell keymap() {					// Maps from keyboard to Firth character map
 	int c = event.key.keysym.sym;
@@ -382,7 +821,7 @@ void vid_draw() {				// Draw a texture image at x,y to dx,dy
 void vid_blit() {				// Write to VGDD Texture Memory
 	source();
 	texture_index = 0;
-	for (int i = 0; i < cnt; ++i)  texture_memory[texture_index++] = ms[i];
+	for (int i = 0; i < cpu->cnt; ++i)  texture_memory[texture_index++] = cpu->ms[i];
 	glBindTexture(GL_TEXTURE_2D,texture_id);
 	glTexImage2D(GL_TEXTURE_2D,0,4,dx,dy,0,GL_RGBA,GL_UNSIGNED_BYTE,texture_memory);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
@@ -401,10 +840,14 @@ struct {
 };
 
 void vid_write(cell val) {			// Write to VGDD command buffer
+	if (cpu->id) return;			// The VGDD is wired to core 0, which owns the GL context
 	video_index %= 3;			// by writing to port 0x7ffffffe one can issue VGDD opcodes
 	video_command[video_index++] = val;	// to the video coprocessor
-	if (vid_vector[video_command[0]].count == video_index) 
+	if (vid_vector[video_command[0]].count == video_index) {
 		vid_vector[video_command[0]].cmd();
+		++vid_commands;
+		++vid_frame_commands;
+	}
 }						// to reset the video display, the sequence: 0 0 0
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -412,6 +855,7 @@ void vid_write(cell val) {			// Write to VGDD command buffer
 cell audio_memory[44100];	// default buffer is 1sec of audio 44100Hz 2 channels 16bit PCM linear
 cell audio_index = 0;		// index into audio memory, current write address
 cell audio_cb_index = 0;	// read offset of the callback routine
+cell audio_level = 0;		// samples left to play at the last interrupt
 
 void audio_callback(void *userdata, Uint8 *stream, int len) {   // the audio emulation system uses a circular
 	if (audio_cb_index == audio_index) {			// write buffer, and a chasing read pointer
@@ -419,6 +863,7 @@ void audio_callback(void *userdata, Uint8 *stream, int len) {   // the audio emu
 		SDL_PauseAudio(1);				// written to the audio memory, and stop
 		return;						// as soon as the current write location 
 	}							// is reached.  Mixing occurs at max volume
+	if (len > sizeof(cell)*(audio_index - audio_cb_index)) ++audio_underruns;
 	len = len > sizeof(cell)*(audio_index - audio_cb_index) ? 	// so the data written must be 
 		sizeof(cell)*(audio_index - audio_cb_index): 		// pre-mixed if a lower volume is
 		len;							// required.
@@ -436,137 +881,487 @@ void audio_init() {			// We initialize audio playback to Red Book CD audio, 44.1
 void aud_write(cell val) {				// Write to audio memory
 	SDL_LockAudio();				
 	source();					// Individual samples, 2 channels at a time, are 
-	if (!ms) return;				// scheduled as mass write using the DMA copy
-	if (utl&0x08) {					// instructions.  The prefered method is to copy
+	if (!cpu->ms) return;				// scheduled as mass write using the DMA copy
+	if (cpu->utl&0x08) {					// instructions.  The prefered method is to copy
 		audio_index %= 44100;			// up to 1/44 seconds of audio, and to prime the
 		audio_memory[audio_index++] = val;	// buffers with new sound every 1/44th of a second
 		return;					// this keeps the latency fairly low, and avoids
 	}						// buffer starvation.  Now fewer than 1024 samples
-	memcpy(audio_memory,ms,cnt*sizeof(cell));	// should be written at any time.
-	audio_index += cnt;
+	memcpy(audio_memory,cpu->ms,cpu->cnt*sizeof(cell));	// should be written at any time.
+	audio_index += cpu->cnt;
 	SDL_UnlockAudio();				// Writes are exclusive, and upon completion will
 	if (SDL_AUDIO_PLAYING != SDL_GetAudioStatus()) SDL_PauseAudio(0);	// trigger audio playback
 }
 
+void audio_watermark() {				// Raise bit 6 of the utility register once
+	cell level = SDL_AUDIO_PLAYING == SDL_GetAudioStatus() && audio_index > audio_cb_index ?
+		audio_index - audio_cb_index : 0;	// the audio left playing drops below the
+	if (level < AUDIO_WATERMARK && audio_level >= AUDIO_WATERMARK) notify(0x40);	// watermark,
+	audio_level = level;				// so core 0 can wait to refill it.
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// headless device functions
+void probe(cell port, cell val) {		// Batch instances run without SDL, so writes to
+	cpu->output = (cpu->output ^ port) * 16777619;	// the VGDD, audio, and network ports
+	cpu->output = (cpu->output ^ val) * 16777619;	// are folded into a signature that
+	++cpu->writes;				// can be compared between runs
+}
+
+void probe_dma(cell val) { probe(cpu->dst,val); }	// DMA writes to a headless device
+
+////////////////////////////////////////////////////////////////////////////////
+// mailbox functions
+void mbox_post(core* c, cell val) {			// Each core has a ring of incoming messages
+	SDL_LockMutex(c->mailbox_lock);			// that any core may post to.  Messages sent
+	if (c->mailbox_tail - c->mailbox_head < MAILBOX_SIZE)	// to a full mailbox are dropped, the
+		c->mailbox[c->mailbox_tail++ % MAILBOX_SIZE] = val;	// receiver sees them in the
+	SDL_UnlockMutex(c->mailbox_lock);		// order they were posted.
+}
+
+cell mbox_read() {					// Read one message from this core's mailbox
+	cell val = 0;					// or 0 if the mailbox is empty.  Bit 4 of
+	SDL_LockMutex(cpu->mailbox_lock);		// the utility register is raised on the next
+	if (cpu->mailbox_head != cpu->mailbox_tail)	// interrupt while messages are pending.
+		val = cpu->mailbox[cpu->mailbox_head++ % MAILBOX_SIZE];
+	SDL_UnlockMutex(cpu->mailbox_lock);
+	return val;
+}
+
+void mbox_write(cell val) {				// Write to the mailbox command buffer
+	cpu->mailbox_index %= 2;			// by writing to port 0x7ffffffa the target
+	cpu->mailbox_command[cpu->mailbox_index++] = val;	// core id followed by the message
+	if (cpu->mailbox_index == 2 && cpu->mailbox_command[0] < core_count)
+		mbox_post(cpu - cpu->id + cpu->mailbox_command[0],val);	// cores are numbered from 0
+}								// within their machine
+
+////////////////////////////////////////////////////////////////////////////////
+// timer functions
+cell timer_read() { return cpu->ticks; }	// The timer port reads the core's clock,
+						// and writing n to it raises bit 8 of the
+void timer_write(cell val) {			// utility register n ticks later, or
+	cpu->alarm = val ? cpu->ticks + val : 0;	// disarms it if n is 0.
+	if (val && !cpu->alarm) cpu->alarm = 1;
+}
+
+void doze() {					// A waiting core's clock runs on, but rather
+	cell skip = NETWORK_RATE - 1 - cpu->ticks % NETWORK_RATE;	// than tick by tick
+	if (cpu->alarm && cpu->alarm - cpu->ticks - 1 < skip)	// it skips ahead to the tick
+		skip = cpu->alarm - cpu->ticks - 1;	// before the next one where a device or
+	if (cpu->slice && cpu->slice - 1 < skip)	// the timer may wake it, or its slice
+		skip = cpu->slice - 1;			// ends.  Once per interrupt period an
+	cpu->ticks += skip;				// interactive core sleeps on the host
+	cpu->idle += skip + 1;				// for a millisecond.  Batch instances and
+	if (cpu->slice) cpu->slice -= skip;		// replays, which run as fast as they can,
+	if (!headless && !cpu->replay && !((cpu->ticks + 1) % INTERRUPT_RATE))	// never
+		SDL_Delay(1);				// sleep, so they skip idle time instantly
+}						// and stay deterministic.
+
+////////////////////////////////////////////////////////////////////////////////
+// instruction cache functions
+cell fetch_far() {				// Fetch the cell at ip from RAM or flash.
+	cell addr = cpu->ip++;			// IM is the core's tightly coupled memory,
+	cell line = addr & ~(ICACHE_LINE - 1);	// everything above it runs through a
+	cell slot = (addr / ICACHE_LINE) % ICACHE_LINES;	// direct mapped cache of
+	cell end = addr & 0x80000000 ? cpu->flash_cells : RAM_SIZE / sizeof(cell);	// lines,
+	if ((line & 0x7fffffff) + ICACHE_LINE > end) {	// filled on a miss.  Devices, and
+		cpu->ip = (addr & 0x0fff) + 1;	// anything past the end of RAM or flash,
+		return cpu->im[addr & 0x0fff];	// hold no code, so ip wraps back into IM
+	}					// there, as it always has.
+	if (cpu->icache_tag[slot] == line) {
+		++cpu->icache_hits;
+		return cpu->icache[slot][addr % ICACHE_LINE];
+	}
+	++cpu->icache_misses;			// The tag is set before the line is
+	master()->icache_live = 1;		// copied, so a core writing it meanwhile
+	cpu->icache_tag[slot] = line;		// finds the tag to clear, and this core
+	__sync_synchronize();			// fills the line again on its next fetch
+	memcpy(cpu->icache[slot],line & 0x80000000 ? &cpu->flash[line & 0x7fffffff] : &cpu->ram[line],
+		sizeof(cpu->icache[slot]));
+	return cpu->icache[slot][addr % ICACHE_LINE];
+}
+
+void icache_written(cell addr, cell n) {	// Drop the cached lines covering n cells
+	cell first = addr & ~(ICACHE_LINE - 1);	// just written at addr, from every core of
+	cell last = (addr + n - 1) & ~(ICACHE_LINE - 1);	// this machine.  Only the slots
+	if (!master()->icache_live || !n || (!(addr & 0x80000000) && (addr < 0x1000 || addr >= 0x7ffffff9)))
+		return;				// the lines map to are checked, or all of
+	__sync_synchronize();			// them for long writes, once the write can
+	for (core* c = master(); c < master() + core_count; ++c)	// be seen by a core
+		for (cell i = 0; i < ICACHE_LINES && i <= (last - first) / ICACHE_LINE; ++i) {	// filling one
+			cell slot = (first / ICACHE_LINE + i) % ICACHE_LINES;
+			if (c->icache_tag[slot] && c->icache_tag[slot] - first <= last - first) {
+				c->icache_tag[slot] = 0;
+				++c->icache_invalidations;
+			}
+		}
+}
+
+void icache_tally(core* c) {			// Add a core's cache statistics to the totals
+	icache_totals[0] += c->icache_hits;
+	icache_totals[1] += c->icache_misses;
+	icache_totals[2] += c->icache_invalidations;
+}
+
+void icache_report() {				// Print the totals, if any core ran code
+	unsigned long long hits = icache_totals[0], misses = icache_totals[1];	// outside IM
+	if (hits + misses) fprintf(stderr,"Icache: %llu hits, %llu misses filling %llu cells, %llu invalidated, %.2f%% hit rate\n",
+		hits,misses,misses * ICACHE_LINE,icache_totals[2],100.0 * hits / (hits + misses));
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // memory functions
-cell* device_read(device_fi f) {			// This utility function is used to do a simple
-	for (int i = 0; i < cnt; ++i) stos(f());	// device read routine.  It can pull 0 to cnt
-	return NULL;					// register cells and place them on the stack.
+cell* device_read(cell* buf, device_fi f) {		// This utility function is used to do a simple
+	for (int i = 0; i < cpu->cnt; ++i)		// device read routine.  It can pull 0 to cnt
+		buf ? (buf[i] = f()) : stos(f());	// register cells into memory, or when copied
+	return NULL;					// to another device place them on the stack.
 }							// NB: the stack is only 8 deep!
 
-cell* device_write(cell* src, device_fo f) {		// This utility function will write a sequence 
-	if (! src || ! f ) return NULL;			// of bytes from an area in memory to the
-	for (int i = 0; i < cnt; ++i) f(src[i]);	// desired function.  This is useful for wrapping
+cell* device_write(cell* buf, device_fo f) {		// This utility function will write a sequence 
+	if (! buf || ! f ) return NULL;			// of bytes from an area in memory to the
+	for (int i = 0; i < cpu->cnt; ++i) f(buf[i]);	// desired function.  This is useful for wrapping
 	return NULL;					// device writes in the DMA routines.
 }
 
 // Read one byte from a memory addr
 void mem_read(cell addr) {				// Read from a memory address (device I/O too)
-	addr & 0x80000000 ? stos(flash[addr & 0x7fffffff]):
+	addr & 0x80000000 ? stos(cpu->flash[addr & 0x7fffffff]):
 	addr == 0x7fffffff ? stos(net_read()):		// As we have both memory mapped IO and multiple
 	addr == 0x7ffffffe ? stos(0):			// distinct addressible memory regions, this 
 	addr == 0x7ffffffd ? stos(0):			// function handles the read mapping for each
 	addr == 0x7ffffffc ? stos(mouse_read()):	// address region.  Those devices which are 
 	addr == 0x7ffffffb ? stos(key_read()):		// output only, will return 0 when read.
-	addr == 0x7ffffffa ? stos(0):
-	addr == 0x7ffffff9 ? stos(0):			// Reads from addresses below 0x1000 will fetch
-	addr < 0x1000 ? stos(rom[addr]):		// from ROM, and not instruction memory which
-	stos(ram[addr]);				// is considered write only!
+	addr == 0x7ffffffa ? stos(mbox_read()):
+	addr == 0x7ffffff9 ? stos(timer_read()):	// Reads from addresses below 0x1000 will fetch
+	addr < 0x1000 ? stos(cpu->rom[addr]):		// from ROM, and not instruction memory which
+	stos(cpu->ram[addr]);				// is considered write only!
 }
 
 // Write one byte from a memory addr
 void mem_write(cell addr, cell value) {			// Write to a memory address (device I/O too)
-	addr & 0x80000000 ? (flash[addr & 0x7fffffff] = value):
+	addr & 0x80000000 ? (cpu->flash[addr & 0x7fffffff] = value):
+	headless && addr > 0x7ffffffc ? probe(addr,value):	// Batch instances have no devices
 	addr == 0x7fffffff ? net_write(value):		// Similarly, writes to each of the address regions
 	addr == 0x7ffffffe ? vid_write(value):		// require mapping from address to device or memory
 	addr == 0x7ffffffd ? aud_write(value): 		// structure.  For those devices that are input only
 	addr == 0x7ffffffc ? nop():			// this routine is effective an expensive nop()
-	addr == 0x7ffffffb ? nop():
-	addr == 0x7ffffffa ? nop():			// Writes to addresses below 0x1000 address 
-	addr == 0x7ffffff9 ? nop():			// instruction memory and modify the executing code
-        addr < 0x1000 ? im[addr] = value:		// no the code stored in ROM!  IM is write only
-	(ram[addr] = value);				// and can be restored from ROM at any time.
+	addr == 0x7ffffffb ? key_write(value):
+	addr == 0x7ffffffa ? mbox_write(value):		// Writes to addresses below 0x1000 address 
+	addr == 0x7ffffff9 ? timer_write(value):	// instruction memory and modify the executing code
+        addr < 0x1000 ? cpu->im[addr] = value:		// no the code stored in ROM!  IM is write only
+	(cpu->ram[addr] = value);			// and can be restored from ROM at any time.
+	icache_written(addr,1);				// Code cached from RAM or flash is dropped
 }
 
 void mem_move(int d) {				// Copy memory from one location to another
-	utl &= 0xfffffff7;			// When we want to copy memory from one region to another
+	cell* buf;
+	cpu->utl &= 0xfffffff7;			// When we want to copy memory from one region to another
 	source();		// this routine will safely write it to a I/O device or
 	destination();		// copy it to the correct region. The direction flag
-	if (ms && md) 				// indicates whether we are writing up or down.
-		d < 0 ? memmove(md-cnt,ms-cnt,cnt*sizeof(cell)) : memmove(md,ms,cnt*sizeof(cell));	
-	else if (!ms) 
-		0x7fffffff == src ? device_read(net_read):		// For the devices a cell at a time
-		0x7ffffffc == src ? device_read(mouse_read):		// is written to the device's address
-		0x7ffffffb == src ? device_read(key_read) : nop();	// For reads, a cell at a time is
-	else if (!md)							// pulled from that address.
-		0x7fffffff == dst ? device_write(ms,net_write):
-		0x7ffffffe == dst ? device_write(ms,vid_write):		// writing device data from a device
-		0x7ffffffd == dst ? device_write(ms,aud_write) : nop();	// read is a bad idea and ill advised
-	utl |= 0x08;
+	cpu->moved += cpu->cnt * sizeof(cell);
+	buf = cpu->md && d < 0 ? cpu->md - cpu->cnt : cpu->md;
+	if (cpu->ms && cpu->md) 		// indicates whether we are writing up or down.
+		d < 0 ? memmove(cpu->md-cpu->cnt,cpu->ms-cpu->cnt,cpu->cnt*sizeof(cell)) : memmove(cpu->md,cpu->ms,cpu->cnt*sizeof(cell));	
+	else if (!cpu->ms) 
+		0x7fffffff == cpu->src ? device_read(buf,net_read):	// For the devices a cell at a time
+		0x7ffffffc == cpu->src ? device_read(buf,mouse_read):	// is written to the device's address
+		0x7ffffffb == cpu->src ? device_read(buf,key_read) : 	// For reads, a cell at a time is
+		0x7ffffffa == cpu->src ? device_read(buf,mbox_read) :	// pulled from that address.
+		0x7ffffff9 == cpu->src ? device_read(buf,timer_read) : nop();
+	else if (!cpu->md)
+		headless && 0x7ffffffc < cpu->dst ? device_write(cpu->ms,probe_dma):
+		0x7fffffff == cpu->dst ? device_write(cpu->ms,net_write):
+		0x7ffffffe == cpu->dst ? device_write(cpu->ms,vid_write):	// writing device data from a device
+		0x7ffffffd == cpu->dst ? device_write(cpu->ms,aud_write):	// read is a bad idea and ill advised
+		0x7ffffffb == cpu->dst ? device_write(cpu->ms,key_write) :
+		0x7ffffffa == cpu->dst ? device_write(cpu->ms,mbox_write) :
+		0x7ffffff9 == cpu->dst ? device_write(cpu->ms,timer_write) : nop();
+	if (cpu->md) icache_written(d < 0 ? cpu->dst - cpu->cnt : cpu->dst,cpu->cnt);
+	cpu->utl |= 0x08;
 }
 
 // NB: we can't compare device data!  Copy to a buffer first.  dst = im, src = rom
 void mem_cmp() {					// Compare to regions of memory (no device I/O)
-	utl &= 0xfffffff7;				// When two regions of memory need to be compared
+	cpu->utl &= 0xfffffff7;				// When two regions of memory need to be compared
 	source();					// this routine will set the cnt register to 0
 	destination();					// if the two regions are identical.
-	if (ms && md) 					// If the regions are different the cnt register
-		cnt = memcmp(ms,md,cnt*sizeof(cell));	// will continue to contain a non-zero value.
-	utl |= 0x08;					// devices can not be compared in this fashion
+	if (cpu->ms && cpu->md) 				// If the regions are different the cnt register
+		cpu->cnt = memcmp(cpu->ms,cpu->md,cpu->cnt*sizeof(cell));	// will continue to contain a non-zero value.
+	cpu->utl |= 0x08;					// devices can not be compared in this fashion
 }
+////////////////////////////////////////////////////////////////////////////////
+// chunked image functions
+typedef struct paged {	// A chunked image paged in as the guest touches it.  Cores see
+	cell* view;	// the view, which starts out inaccessible.  On the first fault in
+	cell* fill;	// a chunk we expand it through fill, a second mapping of the same
+	cell* image;	// memory, so no core sees it half written, and make it read only.
+	size_t image_size;	// Writing to it faults again and marks it dirty, and on
+	size_t size;	// close dirty chunks are compressed and written back to the
+	cell cells;	// image if it was opened for writing.
+	cell chunks;
+	chunk_entry* index;
+	unsigned char* state;	// 0 not paged in, 1 clean, 2 dirty
+	volatile cell lock;	// Held while a fault pages a chunk in
+	int fd;			// Image to write back to, -1 if changes are private
+	const char* file;	// and its name
+	struct paged* next;
+} paged;
+
+paged* paged_images = NULL;	// Every chunked image opened, for the fault handler
+__thread char* paged_retried = NULL;	// Chunk this thread last faulted on while readable
+paged* flash_paged = NULL;	// The flash image, if chunked
+struct sigaction paged_prior[2];	// SIGSEGV and SIGBUS handlers before ours
+
+cell chunk_length(paged* p, cell n) {		// Cells in chunk n, the last may be short
+	return n + 1 < p->chunks ? CHUNK_CELLS : p->cells - n * CHUNK_CELLS;
+}
+
+void paged_fault(int sig, siginfo_t* info, void* context) {	// SIGSEGV and SIGBUS handler.
+	char* a = info->si_addr;		// A fault in an image's view pages in its
+	for (paged* p = paged_images; p; p = p->next) {		// chunk, or marks it dirty
+		cell n;				// if it was already in.  A read can fault on
+		char* at;			// a chunk another core is paging in, so the
+						// first fault on a readable chunk is only
+						// retried, and just a write faults again.
+						// Any other fault goes to the handler before
+						// ours.
+		if (a < (char*)p->view || a >= (char*)p->view + p->size) continue;
+		n = (a - (char*)p->view) / (CHUNK_CELLS * sizeof(cell));
+		at = (char*)p->view + n * CHUNK_CELLS * sizeof(cell);
+		while (__sync_lock_test_and_set(&p->lock,1));
+		if (!p->state[n]) {
+			chunk_entry e = p->index[n];
+			if (e.length && !expand(p->image + e.offset,e.length,p->fill + n * CHUNK_CELLS,chunk_length(p,n)))
+				_exit(NO_CHUNK);
+			mprotect(at,CHUNK_CELLS * sizeof(cell),PROT_READ);
+			p->state[n] = 1;
+		} else if (p->state[n] == 1 && paged_retried != at) {
+			paged_retried = at;
+		} else if (p->state[n] == 1) {
+			mprotect(at,CHUNK_CELLS * sizeof(cell),PROT_READ|PROT_WRITE);
+			p->state[n] = 2;
+			paged_retried = NULL;
+		}
+		__sync_lock_release(&p->lock);
+		return;
+	}
+	sigaction(SIGSEGV,&paged_prior[0],NULL);
+	sigaction(SIGBUS,&paged_prior[1],NULL);
+}
+
+paged* paged_open(int fd, const char* file) {	// Open a chunked image, with a view of
+	struct sigaction sa;			// it in which no chunk is paged in yet.  The
+	struct stat st;				// expanded chunks live in an unlinked file,
+	char tmp[] = "/tmp/ns-flash-XXXXXX";	// which stays sparse where the guest
+	paged* p = calloc(1,sizeof(paged));	// never looks.
+	int t;
+	if (!p || fstat(fd,&st) || st.st_size < CHUNK_HEAD * sizeof(cell)) exit(NO_MAP);
+	p->image_size = st.st_size;
+	p->image = mmap(NULL,p->image_size,PROT_READ,MAP_FILE|MAP_SHARED,fd,0);
+	if (p->image == MAP_FAILED) exit(NO_MAP);
+	p->cells = p->image[1];
+	p->chunks = p->image[2];
+	if (p->chunks != (p->cells + CHUNK_CELLS - 1) / CHUNK_CELLS
+	|| (CHUNK_HEAD + 2 * (size_t)p->chunks) * sizeof(cell) > p->image_size) exit(NO_CHUNK);
+	for (cell n = 0; n < p->chunks; ++n) {
+		chunk_entry* e = (chunk_entry*)(p->image + CHUNK_HEAD) + n;
+		if (((size_t)e->offset + e->length) * sizeof(cell) > p->image_size) exit(NO_CHUNK);
+	}
+	p->size = (size_t)p->chunks * CHUNK_CELLS * sizeof(cell);
+	p->index = malloc(p->chunks * sizeof(chunk_entry));
+	p->state = calloc(p->chunks,1);
+	if (!p->index || !p->state) exit(NO_RAM);
+	memcpy(p->index,p->image + CHUNK_HEAD,p->chunks * sizeof(chunk_entry));
+	if ((t = mkstemp(tmp)) < 0) exit(NO_RAM);
+	unlink(tmp);
+	if (ftruncate(t,p->size)) exit(NO_RAM);
+	p->view = mmap(NULL,p->size,PROT_NONE,MAP_FILE|MAP_SHARED,t,0);
+	p->fill = mmap(NULL,p->size,PROT_READ|PROT_WRITE,MAP_FILE|MAP_SHARED,t,0);
+	close(t);
+	if (p->view == MAP_FAILED || p->fill == MAP_FAILED) exit(NO_MAP);
+	p->fd = file ? fd : -1;		// Changes are written back to the file if named
+	p->file = file;
+	if (!paged_images) {
+		memset(&sa,0,sizeof(sa));
+		sa.sa_sigaction = paged_fault;
+		sa.sa_flags = SA_SIGINFO|SA_RESTART;
+		sigaction(SIGSEGV,&sa,&paged_prior[0]);
+		sigaction(SIGBUS,&sa,&paged_prior[1]);
+	}
+	p->next = paged_images;		// Images are only opened before the cores or
+	paged_images = p;		// workers start, so the list is never changing
+	return p;			// under the handler.
+}
+
+cell paged_save(paged* p) {			// Write the image with its dirty chunks to a
+	char file[1024];			// new file, every chunk in order after the
+	cell head[CHUNK_HEAD] = { CHUNKED_MAGIC, p->cells, p->chunks };	// header
+	cell offset = CHUNK_HEAD + 2 * p->chunks;	// and index, and rename it over
+	cell* buffer = malloc((CHUNK_CELLS + 1) * sizeof(cell));	// the old one, so
+	struct stat st;				// a crash leaves one image or the other
+	int out = -1, ok;			// whole.  Returns 0 if it could not be saved.
+	if (!buffer) exit(NO_RAM);
+	snprintf(file,sizeof(file),"%s.tmp",p->file);
+	ok = !fstat(p->fd,&st) && (out = open(file,O_CREAT|O_WRONLY|O_TRUNC,st.st_mode & 0777)) >= 0;
+	for (cell n = 0; ok && n < p->chunks; ++n) {
+		cell len = chunk_length(p,n), k = p->index[n].length;
+		cell* data = p->image + p->index[n].offset;
+		if (p->state[n] == 2) {
+			k = squeeze(p->fill + n * CHUNK_CELLS,len,data = buffer);
+			if (k == 2 && buffer[0] == (0x80000000 | len) && !buffer[1]) k = 0;
+		}
+		p->index[n].offset = k ? offset : 0;
+		p->index[n].length = k;
+		ok = pwrite(out,data,k * sizeof(cell),(off_t)offset * sizeof(cell)) == k * sizeof(cell);
+		offset += k;
+	}
+	ok = ok && pwrite(out,head,sizeof(head),0) == sizeof(head)	// The index goes
+	&& pwrite(out,p->index,p->chunks * sizeof(chunk_entry),sizeof(head))	// last
+		== p->chunks * sizeof(chunk_entry) && !fsync(out);
+	if (out >= 0 && close(out)) ok = 0;
+	if (!ok || rename(file,p->file)) {
+		if (out >= 0) unlink(file);
+		ok = 0;
+	}
+	free(buffer);
+	return ok;
+}
+
+cell paged_close(paged* p) {			// Save the image if anything was written to
+	cell saved = 1;				// it, and release the memory.  Returns 0 if
+	for (cell n = 0; p->fd >= 0 && n < p->chunks; ++n)	// the image could not
+		if (p->state[n] == 2) {		// be saved.
+			saved = paged_save(p);
+			break;
+		}
+	if (p->fd >= 0) close(p->fd);
+	p->size = 0;			// The handler skips closed images
+	munmap(p->view,(size_t)p->chunks * CHUNK_CELLS * sizeof(cell));
+	munmap(p->fill,(size_t)p->chunks * CHUNK_CELLS * sizeof(cell));
+	munmap(p->image,p->image_size);
+	return saved;
+}
+
+cell chunked(int fd) {				// Tell if an image is chunked
+	cell magic = 0;
+	return pread(fd,&magic,sizeof(magic),0) == sizeof(magic) && magic == CHUNKED_MAGIC;
+}
+
+cell flash_close() {				// Save the flash image and close it,
+	cell saved = 1;				// returns 0 if it could not be saved
+	if (flash_paged) saved = paged_close(flash_paged);
+	else {
+		munmap(flash,flash_size);
+		close(flash_fd);
+	}
+	flash_paged = NULL;
+	if (!saved) fprintf(stderr,"Can not save %s\n",flash_file);
+	return saved;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // end simulation
 void end() {
-	munmap(flash,flash_size);	// First we save the current flash image, and close the file
-	close(flash_fd);		// handle, deconstruct the system resources, and then exit
+	record(TRACE_END,NULL,0);	// Close off any trace being recorded
+	if (cpu->trace) fclose(cpu->trace);
+	if (profile_rate) profile_write();
+	running = 0;			// Stop the other cores and wait for them to finish their
+	for (cell i = 1; i < core_count; ++i)	// current interrupt period, so nobody touches
+		SDL_WaitThread(cores[i].thread,NULL);	// flash once it has been unmapped.
+	cell saved = flash_close();	// First we save the current flash image, and close the file
+					// handle, deconstruct the system resources, and then exit
 	SDL_Quit();			// with a message describing the observed system performance
 	fprintf(stderr,"Effective Speed: %dMHz @ %d samples\n",rate/1000,samples);
-	exit(0);
+	for (cell i = 0; i < core_count; ++i) icache_tally(&cores[i]);
+	icache_report();
+	if (telemetry_made) unlink(telemetry_path);	// and remove the telemetry socket
+	exit(saved ? 0 : NO_SAVE);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 // interrupt simulation
-void interrupt() {			// Simulate a device interrupt
-	now = SDL_GetTicks();
-	utl &= 0xfffffff0;
-	if (SDL_PollEvent(&event)) switch(event.type) {
+void deliver() {			// Queue a host event for core 0, stamped with
+	cell e[4] = { cpu->ticks, 0, 0, 0 };	// the tick it arrived on
+	switch(event.type) {
 		case SDL_QUIT:
 			end();
 		case SDL_KEYDOWN:
-			utl |= 1;
-			key_buffer = 0x80 | keymap();
 			if (event.key.keysym.sym == SDLK_ESCAPE) end();
+			e[1] = INPUT_KEY;
+			e[2] = 0x80 | keymap();
 			break;
 		case SDL_KEYUP:
-			utl |= 1;
-			key_buffer = 0x7f & keymap();
+			e[1] = INPUT_KEY;
+			e[2] = 0x7f & keymap();
 			break;
 		case SDL_MOUSEMOTION:
-			utl |= 2;
-			mouse_buffer[0] = event.motion.x;
-			mouse_buffer[1] = event.motion.y;
+			e[1] = INPUT_MOTION;
+			e[2] = event.motion.x;
+			e[3] = event.motion.y;
 			break;
 		case SDL_MOUSEBUTTONDOWN:
-			utl |= 2;
-			mouse_buffer[2] = 0x80 | (1 << (event.button.button-1));
+			e[1] = INPUT_BUTTON;
+			e[2] = 0x80 | (1 << (event.button.button-1));
 			break;
 		case SDL_MOUSEBUTTONUP:
-			utl |= 2;
-			mouse_buffer[2] = 0x7f & (1 << (event.button.button-1));
+			e[1] = INPUT_BUTTON;
+			e[2] = 0x7f & (1 << (event.button.button-1));
 			break;
-		default: break;
+		default: return;
 	}
+	record(TRACE_INPUT,e,sizeof(e));	// Log what was queued
+	input_push(e);
+}
+
+cell interrupt() {			// Simulate a device interrupt
+	cpu->utl &= 0xfffffe00;		// Events are raised through notify(), which also
+	if (cpu->mailbox_head != cpu->mailbox_tail) notify(0x10);	// wakes a waiting core
+	if (cpu->id) return running;	// Host events are only delivered to core 0
+	if (!headless) audio_watermark();
+	if (cpu->replay)		// Replayed events stand in for host input, up to
+		while (replay(0));	// the end of the trace, which halts the machine.
+	if (!headless) {		// The host queue is still drained so the window
+		now = SDL_GetTicks();	// can be closed in the middle of a replay.  Every
+		while (SDL_PollEvent(&event))	// pending event is queued each interrupt.
+			cpu->replay ? (event.type == SDL_QUIT ? end() : nop()) : deliver();
+	}
+	input_deliver();
+	if (cpu->halted && !headless) end();	// The end of a replay ends the simulation
+	return running && !cpu->halted;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 // system clock simulation
+cell bucket(cell val, cell* limits, cell n) {	// Histogram bucket of val, the last of
+	cell b = 0;				// the n buckets holds everything above
+	while (b < n - 1 && val > limits[b]) ++b;	// the limits
+	return b;
+}
+
+void frame_count() {				// Count the frame just drawn, the time it
+	cell ms = now - last;			// took, and how many frame periods it ran
+	cell missed = ms / REFRESH_RATE ? ms / REFRESH_RATE - 1 : 0;	// over.  The first
+	vid_last_commands = vid_frame_commands;	// frame only counts its commands.
+	vid_frame_commands = 0;
+	++frames;
+	if (!last) return;
+	frame_ms += ms;
+	++frame_hist[bucket(ms,frame_limits,FRAME_BUCKETS)];
+	frames_missed += missed;
+	++missed_hist[bucket(missed,missed_limits,MISSED_BUCKETS)];
+}
+
 void update() {					// Simulate attached devices
+	cell ticks = 0;				// The system clock is the sum of all core clocks,
+	for (cell i = 0; i < core_count; ++i) ticks += cores[i].ticks - cores[i].idle;	// less idle
 	++samples;				// update statistical sample count
 	rate = (rate*samples + (24*(ticks - period)/1000))/samples; // avg ticks per frame
 	period = ticks;				// reset the priod counter
 	SDL_GL_SwapBuffers();			// update the video frame
+	if (profile_rate) profile_drain();	// fold any profile samples
+	frame_count();				// count it for the telemetry
 	last = now;				// reset the frame refresh window
+	notify(0x80);				// and tell core 0 a frame has passed
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -574,21 +1369,31 @@ void update() {					// Simulate attached devices
 void go() {					// Simulate Decoder & ALU
 	cell instr;				// This cell holds the current instruction pointer
 	int a, b;				// a and b are temporary variables
+	cell* p;				// p points at a shared cell for the atomic ops
 fetch:						// First update the psystem clock "tick". 
-	++ticks;					// In order to mimic hardware updates, 
-	if (!(ticks % INTERRUPT_RATE)) interrupt();	// we fire off periodic interrupts
-	if (now - last >= REFRESH_RATE) update();	// and device updates, on the uptick
-	if (!(ticks % NETWORK_RATE)) net_interrupt();	
-	ip &= 0x0fff;				// Then we fetch the next instruction, keeping
-	instr = im[ip++];			// the instruction pointer within the 0x1000 byte
-	if (! (instr & 0x80000000)) { 		// instruction memory.  We read 1 cell at a time
+	if (cpu->slice && !--cpu->slice) return;	// Batch instances run in time slices.
+	++cpu->ticks;				// In order to mimic hardware updates, 
+	if (!(cpu->ticks % INTERRUPT_RATE) && !interrupt()) return;	// we fire off periodic interrupts
+	if (!cpu->id && now - last >= REFRESH_RATE) update();	// and device updates, on the uptick
+	if (!(cpu->ticks % NETWORK_RATE)) net_interrupt();	
+	if (cpu->ticks == cpu->alarm && cpu->alarm) {	// The timer raises its event
+		cpu->alarm = 0;				// and disarms itself
+		notify(0x100);
+	}
+	if (cpu->waiting) {			// A core halted by wait idles until one
+		doze();				// of the events it waits on is raised
+		goto fetch;
+	}
+	instr = cpu->ip < CACHE_SIZE ?		// Then we fetch the next instruction, from the
+		cpu->im[cpu->ip++] : fetch_far();	// instruction memory, or from RAM or flash
+	if (! (instr & 0x80000000)) { 		// through the cache.  We read 1 cell at a time
 		up(instr);			// which contains either 1 literal instruction or
 		goto fetch;			// 4 opcode based instructions.  Literals kick us
 	}					// to the next system clock, but all 4 instructions
 next_op:					// are evaluated within a single system clock "tick"
 	switch(instr & 0xff) {			// reading the LSB->MSB encoded opcodes we execute:
 		case 0x80: goto next;					// nop
-		case 0x81: upr(ip); ip = tos(); down(); goto fetch;	// call
+		case 0x81: upr(cpu->ip); cpu->ip = tos(); down(); goto fetch; // call
 		case 0x82: down(); goto next;				// drop
 		case 0x83: snos(tos()); down(); goto next;		// nip
 		case 0x84: upr(tos()); down(); goto next;		// push
@@ -603,9 +1408,9 @@ next_op:					// are evaluated within a single system clock "tick"
 		case 0x8d: stos(tos()<<8); goto next;			// shift char left
 		case 0x8e: up(0); goto next;				// zero
 		case 0x8f: up(1); goto next;				// one
-		case 0x90: ip = rtos(); downr(); goto fetch;		// jump
+		case 0x90: cpu->ip = rtos(); downr(); goto fetch;	// jump
 		case 0x91: if (!nos()) down(); down(); goto next; 	// conditional jump
-				ip = tos(); down(); down(); goto fetch; // (nos ~= 0 -> jump)
+				cpu->ip = tos(); down(); down(); goto fetch; // (nos ~= 0 -> jump)
 		case 0x92: up(tos()); goto next;			// dup
 		case 0x93: up(nos()); goto next;			// over
 		case 0x94: up(rtos()); downr(); goto next;		// pop
@@ -618,20 +1423,26 @@ next_op:					// are evaluated within a single system clock "tick"
 		case 0x9b: up(nos() != tos() ? -1 : 0); goto next;	// unequal
 		case 0x9c: stos(tos()>>1); goto next;			// shift right
 		case 0x9d: stos(tos()>>8); goto next;			// shift char right
-		case 0x9e: up(utl); goto next;				// utility register
+		case 0x9e: up(cpu->utl); goto next;			// utility register
 		case 0x9f: up(-1); goto next;				// negative one
 		case 0xa0: mem_move(-1); goto next;			// copy down
-		case 0xa1: up(cnt); goto next;				// fetch count
-		case 0xa2: up(src); goto next;				// fetch source		
-		case 0xa3: up(dst); goto next;				// fetch destination
+		case 0xa1: up(cpu->cnt); goto next;			// fetch count
+		case 0xa2: up(cpu->src); goto next;			// fetch source		
+		case 0xa3: up(cpu->dst); goto next;			// fetch destination
+		case 0xa4: up(cpu->id); goto next;			// core id
+		case 0xa5: b = tos(); p = shared(b); down();		// fetch and add
+				stos(p ? __sync_fetch_and_add(p,tos()) : 0); icache_written(b,1); goto next;
+		case 0xa6: b = tos(); p = shared(b); down(); a = tos(); down();	// compare and swap
+				stos(p ? __sync_val_compare_and_swap(p,a,tos()) : 0); icache_written(b,1); goto next;
+		case 0xa7: cpu->waiting = tos() ? tos() : ANY_EVENT; down(); goto next;	// wait
 		case 0xc0: mem_cmp(); goto next;			// compare up
-		case 0xc1: ++cnt; goto next;				// increment count
-		case 0xc2: up(0); mem_read(src++); goto next;		// source read
-		case 0xc3: mem_write(dst++,tos()); goto next;		// destination write
+		case 0xc1: ++cpu->cnt; goto next;			// increment count
+		case 0xc2: up(0); mem_read(cpu->src++); goto next;	// source read
+		case 0xc3: mem_write(cpu->dst++,tos()); goto next;	// destination write
 		case 0xe0: mem_move(1); goto next;			// copy up
-		case 0xe1: cnt = tos(); goto next;			// store count
-		case 0xe2: src = tos(); goto next;			// store source
-		case 0xe3: dst = tos(); goto next;			// store destination
+		case 0xe1: cpu->cnt = tos(); goto next;			// store count
+		case 0xe2: cpu->src = tos(); goto next;			// store source
+		case 0xe3: cpu->dst = tos(); goto next;			// store destination
 		default: break;					// ignore unkown opcodes
 	}
 next:						// When each opcode finishes, we advance instr to the 
@@ -643,7 +1454,6 @@ next:						// When each opcode finishes, we advance instr to the
 ////////////////////////////////////////////////////////////////////////////////
 // platform initialization
 void init() {				// Initialize Platform Specific Application Settings
-	ticks = 0;			// Here we clear the fake system clock and
 	SDL_Init(SDL_INIT_EVERYTHING);	// tell SDL to setup video, audio, and devices
 	video_init();			// assuming each of these work we will have a
 	audio_init();			// fully functional environment.  Otherwise
@@ -653,13 +1463,25 @@ void init() {				// Initialize Platform Specific Application Settings
 ////////////////////////////////////////////////////////////////////////////////
 // vm initialization
 void reset() {					// Reset the VM, unmap flash if loaded
-	ip = dsi = rsi = cnt = src = dst = utl = 0;
+	for (cell i = 0; i < core_count; ++i) {	// Each core starts with cleared registers
+		core* c = &cores[i];		// stacks and clock, and an empty mailbox.
+		c->ip = c->dsi = c->rsi = c->cnt = c->src = c->dst = c->utl = 0;
+		c->ticks = c->mailbox_head = c->mailbox_tail = c->mailbox_index = 0;
+		c->idle = c->waiting = c->alarm = 0;
+		c->input_head = c->input_tail = c->input_cell = c->input_dropped = c->input_queued = 0;
+		c->id = i;			// The core id register is hardwired
+		memset(c->icache_tag,0,sizeof(c->icache_tag));	// the cache starts empty
+		c->icache_hits = c->icache_misses = c->icache_invalidations = c->icache_live = 0;
+		c->rom = rom;			// and every core is wired to the same ROM
+		if (!c->mailbox_lock) c->mailbox_lock = SDL_CreateMutex();
+	}
 	ram = mmap(NULL,RAM_SIZE,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANON,-1,0);
 	if (ram == (cell*)0xffffffff) exit(NO_RAM);	// We use an anonymous block as our RAM
-	if (flash) {				// the flash file is mapped to an actual
-		munmap(flash,flash_size);	// file on the host system.  This mimics
-		close(flash_fd);		// the NUMA architecture of the emulated
-	}					// device.  Address ranges are handled
+	for (cell i = 0; i < core_count; ++i) cores[i].ram = ram;
+	if (flash && !flash_close()) exit(NO_SAVE);	// the flash file is mapped to an actual
+						// file on the host system.  This mimics
+						// the NUMA architecture of the emulated
+						// device.  Address ranges are handled
 	flash = NULL;				// through translation.
 }
 
@@ -671,25 +1493,391 @@ void boot() {						// Load the flash image, and start VM
 	if (flash_fd < 0) exit(NO_FILE);		// actual size and attempt to map that 
 	fstat(flash_fd,&st);				// image into memory.  Once the image is 
 	flash_size = st.st_size;			// loaded, we copy the first 16kB from the
-	flash = mmap(NULL,flash_size,PROT_READ|PROT_WRITE,MAP_FILE|MAP_SHARED,flash_fd,0);
-	if (flash < 0) exit(NO_MAP);			// file into both our ROM buffer and our
-	if (flash_size < ROM_SIZE) exit(NO_ROM);	// instruction memory buffer.
-	memcpy(rom,flash,ROM_SIZE);			// This allows us to treat these as distinct
-	memcpy(im,flash,ROM_SIZE);			// entities, and alterations to flash will not
-}							// alter our ROMs at runtime.
+	if (chunked(flash_fd)) {			// file into both our ROM buffer and each
+		flash_paged = paged_open(flash_fd,flash_file);	// core's instruction
+		flash = flash_paged->view;		// memory buffer.  (A chunked image is
+		flash_size = flash_paged->cells * sizeof(cell);	// paged in as it is
+	} else flash = mmap(NULL,flash_size,PROT_READ|PROT_WRITE,MAP_FILE|MAP_SHARED,flash_fd,0);
+	if (flash < 0) exit(NO_MAP);			// used, and written back on exit.)  This
+	if (flash_size < sizeof(rom)) exit(NO_ROM);	// allows us to treat these as distinct
+	memcpy(rom,flash,sizeof(rom));			// entities, and alterations to flash will
+	for (cell i = 0; i < core_count; ++i) {		// not alter our ROMs at runtime.
+		cores[i].flash = flash;
+		cores[i].flash_cells = flash_size / sizeof(cell);
+		memcpy(cores[i].im,rom,sizeof(rom));
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// multi-core simulation
+int run(void* c) {			// Host thread entry point for a guest core.  Every
+	cpu = c;			// core boots from instruction 0 of its own copy of
+	go();				// the ROM, and can use its core id to pick its work.
+	return 0;			// go() returns once end() stops the cores.
+}
+
+void start() {				// Start cores 1..n on their own host threads, core 0
+	for (cell i = 1; i < core_count; ++i)	// stays on the main thread where it owns
+		cores[i].thread = SDL_CreateThread(run,&cores[i]);	// SDL and OpenGL.
+	run(&cores[0]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// batch simulation
+typedef struct {
+	core c;			// The instance's single core, wired to its own memory
+	char* file;		// Image the instance boots from
+	char* trace;		// Trace of events the instance replays, if any
+	cell flash_size;	// Size of the private flash mapping
+	paged* paged;		// Its flash, if the image is chunked
+	cell budget;		// Ticks the instance runs for before it is finished
+	unsigned long long usec;	// Host time spent running its slices
+} instance;
+
+typedef struct {
+	instance** queue;	// Deque of runnable instances, the owner works at the
+	cell top;		// bottom and thieves take from the top
+	cell bottom;
+	SDL_mutex* lock;	// Guards the deque against thieves
+	SDL_Thread* thread;	// Host thread running this worker
+} worker;
+
+instance* instances;		// Every VM instance in the batch
+cell instance_count = 0;
+worker* workers;		// Host threads scheduling instances
+cell worker_count = 0;
+cell slice_size = SLICE_SIZE;	// Ticks an instance runs before going back in a queue
+cell batch_ticks = 0;		// Ticks each instance runs in total, if set
+volatile cell remaining;		// Instances not yet finished
+volatile cell sleepers = 0;	// Workers parked with nothing to steal
+SDL_mutex* idle_lock;		// Guards parking, so no wakeup falls between a
+SDL_cond* idle_cond;		// worker's last look at the deques and its wait
+
+unsigned long long usec() {		// Host clock in microseconds for instance timings
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+void wake(cell all) {			// Rouse one parked worker, or all of them
+	SDL_LockMutex(idle_lock);
+	all ? SDL_CondBroadcast(idle_cond) : SDL_CondSignal(idle_cond);
+	SDL_UnlockMutex(idle_lock);
+}
+
+void push(worker* w, instance* i) {	// Return an instance to the bottom of a deque,
+	cell spare;			// waking a parked worker if the owner now has
+	SDL_LockMutex(w->lock);		// more than it will take back itself
+	w->queue[w->bottom++ % instance_count] = i;
+	spare = w->bottom - w->top > 1;
+	SDL_UnlockMutex(w->lock);
+	__sync_synchronize();
+	if (spare && sleepers) wake(0);
+}
+
+instance* pop(worker* w, cell top) {	// Take an instance from either end of a deque
+	instance* i = NULL;		// the owner takes from the bottom, which keeps
+	SDL_LockMutex(w->lock);		// its most recently run instance warm in cache,
+	if (w->top != w->bottom)	// while thieves take the oldest from the top.
+		i = top ? w->queue[w->top++ % instance_count] : w->queue[--w->bottom % instance_count];
+	SDL_UnlockMutex(w->lock);
+	return i;
+}
+
+instance* steal(worker* w) {		// Look for work in the other workers' deques
+	for (cell n = 1; n < worker_count; ++n) {
+		instance* i = pop(&workers[(w - workers + n) % worker_count],1);
+		if (i) return i;
+	}
+	return NULL;
+}
+
+void park() {				// Wait for an instance to be pushed where we
+	cell queued = 0;		// could steal it, or the last to finish.  We
+	SDL_LockMutex(idle_lock);	// count ourselves before looking at the deques,
+	__sync_fetch_and_add(&sleepers,1);	// and push looks for sleepers after
+	for (cell n = 0; n < worker_count; ++n)	// queueing, so one of us always sees
+		queued |= workers[n].top != workers[n].bottom;	// the other.
+	if (remaining && !queued) SDL_CondWait(idle_cond,idle_lock);
+	__sync_fetch_and_sub(&sleepers,1);
+	SDL_UnlockMutex(idle_lock);
+}
+
+int work(void* data) {			// Worker loop: run one slice of an instance at a
+	worker* w = data;		// time, requeue it locally if it isn't finished,
+	instance* i;			// and steal when our own deque runs dry.
+	unsigned long long t;
+	while (remaining) {
+		if (!(i = pop(w,0)) && !(i = steal(w))) {
+			park();		// Everything left is running on other workers
+			continue;
+		}
+		cpu = &i->c;
+		cpu->slice = (i->budget - cpu->ticks < slice_size ? i->budget - cpu->ticks : slice_size) + 1;
+		t = usec();
+		go();
+		i->usec += usec() - t;
+		if (profile_rate && w == workers) profile_drain();	// worker 0 folds samples
+		if (cpu->ticks < i->budget && !cpu->halted) push(w,i);
+		else {			// Finished instances release their memory
+			munmap(cpu->ram,RAM_SIZE);
+			if (i->paged) paged_close(i->paged);
+			else munmap(cpu->flash,i->flash_size);
+			if (cpu->trace) fclose(cpu->trace);
+			if (!__sync_sub_and_fetch(&remaining,1)) wake(1);
+		}
+	}
+	return 0;
+}
+
+cell* batch_rom(instance* i) {		// Instances booted from the same image share one
+	for (instance* j = instances; j < i; ++j)	// read only mapping of its ROM.
+		if (!strcmp(j->file,i->file)) return j->c.rom;
+	return NULL;
+}
+
+void batch_boot(instance* i) {		// Boot an instance with private RAM, a private copy
+	struct stat st;			// on write mapping of its flash image, and a
+	core* c = &i->c;		// shared ROM.  Untouched flash pages stay shared
+	int fd = open(i->file,O_RDONLY);	// between instances of the same image.
+	if (fd < 0) exit(NO_FILE);
+	fstat(fd,&st);
+	i->flash_size = st.st_size;
+	i->budget = batch_ticks ? batch_ticks :		// Replays run to the end of their
+		i->trace ? 0xffffffff : BATCH_TICKS;	// trace unless told otherwise.
+	if (chunked(fd)) {			// A chunked image is paged in privately,
+		i->paged = paged_open(fd,NULL);	// and its ROM copied out of the first chunk
+		i->flash_size = i->paged->cells * sizeof(cell);
+		c->flash = i->paged->view;
+	} else c->flash = mmap(NULL,i->flash_size,PROT_READ|PROT_WRITE,MAP_FILE|MAP_PRIVATE,fd,0);
+	if (i->flash_size < sizeof(rom)) exit(NO_ROM);
+	if (c->flash == MAP_FAILED) exit(NO_MAP);
+	c->flash_cells = i->flash_size / sizeof(cell);
+	if (!(c->rom = batch_rom(i))) {
+		c->rom = i->paged ? malloc(sizeof(rom)) : mmap(NULL,sizeof(rom),PROT_READ,MAP_FILE|MAP_SHARED,fd,0);
+		if (!c->rom || c->rom == MAP_FAILED) exit(NO_MAP);
+		if (i->paged) memcpy(c->rom,c->flash,sizeof(rom));
+	}
+	close(fd);
+	c->ram = mmap(NULL,RAM_SIZE,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANON,-1,0);
+	if (c->ram == MAP_FAILED) exit(NO_RAM);
+	c->mailbox_lock = SDL_CreateMutex();
+	memcpy(c->im,c->rom,sizeof(rom));
+	if (i->trace) trace_open(c,i->trace,1);
+}
+
+void batch_init(char** files, cell count) {	// Boot many independent VM instances in
+	headless = 1;			// this process, to be run by a pool of worker
+	core_count = 1;			// threads.
+	instance_count = count;
+	instances = calloc(instance_count,sizeof(instance));
+	workers = calloc(worker_count,sizeof(worker));
+	if (!instances || !workers) exit(NO_RAM);
+	for (cell i = 0; i < instance_count; ++i) {	// Each file may name a trace to replay
+		instances[i].file = files[i];		// after a comma, image.nsi,session.nst
+		if ((instances[i].trace = strchr(files[i],','))) *instances[i].trace++ = '\0';
+		batch_boot(&instances[i]);
+	}
+}
+
+void batch() {				// Run the instances.  They are dealt round robin
+	unsigned long long t, ticks = 0;	// into the workers' deques, and idle workers
+	if (profile_rate) profile_start(instances[0].c.flash,instances[0].flash_size);	// steal.
+	for (cell i = 0; i < worker_count; ++i) {
+		workers[i].queue = calloc(instance_count,sizeof(instance*));
+		workers[i].lock = SDL_CreateMutex();
+	}
+	idle_lock = SDL_CreateMutex();
+	idle_cond = SDL_CreateCond();
+	for (cell i = 0; i < instance_count; ++i) push(&workers[i % worker_count],&instances[i]);
+	remaining = instance_count;
+	t = usec();
+	for (cell i = 1; i < worker_count; ++i) workers[i].thread = SDL_CreateThread(work,&workers[i]);
+	work(&workers[0]);
+	for (cell i = 1; i < worker_count; ++i) SDL_WaitThread(workers[i].thread,NULL);
+	t = usec() - t;
+	printf("instance\tticks\tidle\tms\tMIPS\tsignature\twrites\ttos\timage\n");
+	for (cell i = 0; i < instance_count; ++i) {	// Report each instance's results in order
+		core* c = &instances[i].c;
+		ticks += c->ticks - c->idle;	// MIPS count the ticks spent running
+		printf("%u\t%u\t%u\t%llu\t%.1f\t%08x\t%u\t%08x\t%s\n",i,c->ticks,c->idle,
+			instances[i].usec/1000,instances[i].usec ? (double)(c->ticks - c->idle)/instances[i].usec : 0.0,
+			c->output,c->writes,c->ds[c->dsi],instances[i].file);
+		icache_tally(c);
+	}
+	printf("%u instances on %u workers in %llums, %.1f MIPS aggregate\n",instance_count,worker_count,
+		t/1000,t ? (double)ticks/t : 0.0);
+	icache_report();
+	if (profile_rate) profile_write();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// telemetry
+int telemetry_fd = -1;		// Listening socket
+cell* telemetry_seen;		// Ticks each core had spent running at the last sample
+unsigned long long telemetry_retired = 0;	// Instructions retired by all cores
+double telemetry_mips = 0.0;	// Over the last second
+unsigned long long telemetry_failed = 0;	// Dumps cut short by a client that went away
+
+core* telemetry_core(cell i) {		// The i-th core of this machine, or of the batch
+	return headless ? (i < instance_count ? &instances[i].c : NULL) :
+		i < core_count ? &cores[i] : NULL;
+}
+
+unsigned long long resident(void* p, size_t len) {	// Bytes of a mapping resident in
+	size_t page = sysconf(_SC_PAGESIZE), n = (len + page - 1) / page;	// host memory
+	unsigned long long r = 0;
+	unsigned char* v = malloc(n);
+	if (p && v && !mincore(p,len,(void*)v))
+		for (size_t i = 0; i < n; ++i) r += v[i] & 1;
+	free(v);
+	return r * page;
+}
+
+void telemetry_sample() {		// Fold the cores' clocks into the retired count.
+	static unsigned long long start = 0, base = 0;	// Clocks are read without locks,
+	unsigned long long t = usec();	// and may be caught half way through skipping
+	core* c;			// idle time, so only forward steps are counted.
+	for (cell i = 0; (c = telemetry_core(i)); ++i) {
+		int step = c->ticks - c->idle - telemetry_seen[i];
+		if (step <= 0) continue;
+		telemetry_retired += step;
+		telemetry_seen[i] += step;
+	}
+	if (!start) start = t;
+	if (t - start < 1000000) return;
+	telemetry_mips = (double)(telemetry_retired - base) / (t - start);
+	start = t;
+	base = telemetry_retired;
+}
+
+void telemetry_histogram(FILE* f, const char* name, unsigned long long* hist, cell* limits, cell n) {
+	unsigned long long total = 0;	// Histograms are kept per bucket, and written
+	for (cell b = 0; b < n; ++b) {	// cumulatively
+		total += hist[b];
+		if (b < n - 1) fprintf(f,"%s_bucket{le=\"%u\"} %llu\n",name,limits[b],total);
+		else fprintf(f,"%s_bucket{le=\"+Inf\"} %llu\n",name,total);
+	}
+	fprintf(f,"%s_count %llu\n",name,total);
+}
+
+void telemetry_dump(int fd) {		// Write every counter in the Prometheus text
+	FILE* f = fdopen(fd,"w");	// format, and close the connection
+	unsigned long long moved = 0, idle = 0, ram_rss = 0, flash_rss = 0;
+	core* c;
+	if (!f) {
+		close(fd);
+		return;
+	}
+	for (cell i = 0; (c = telemetry_core(i)); ++i) {
+		moved += c->moved;
+		idle += c->idle;
+		if (headless) {
+			ram_rss += resident(c->ram,RAM_SIZE);
+			flash_rss += resident(c->flash,instances[i].flash_size);
+		}
+	}
+	if (!headless) {
+		ram_rss = resident(ram,RAM_SIZE);
+		flash_rss = resident(flash,flash_size);
+	}
+	fprintf(f,"# TYPE ns_instructions_total counter\nns_instructions_total %llu\n",telemetry_retired);
+	fprintf(f,"# TYPE ns_mips gauge\nns_mips %.3f\n",telemetry_mips);
+	fprintf(f,"# TYPE ns_idle_ticks_total counter\nns_idle_ticks_total %llu\n",idle);
+	fprintf(f,"# TYPE ns_frames_total counter\nns_frames_total %llu\n",frames);
+	fprintf(f,"# TYPE ns_frame_ms histogram\n");
+	telemetry_histogram(f,"ns_frame_ms",frame_hist,frame_limits,FRAME_BUCKETS);
+	fprintf(f,"ns_frame_ms_sum %llu\n",frame_ms);
+	fprintf(f,"# TYPE ns_frames_missed_total counter\nns_frames_missed_total %llu\n",frames_missed);
+	fprintf(f,"# TYPE ns_frames_missed histogram\n");
+	telemetry_histogram(f,"ns_frames_missed",missed_hist,missed_limits,MISSED_BUCKETS);
+	fprintf(f,"ns_frames_missed_sum %llu\n",frames_missed);
+	fprintf(f,"# TYPE ns_video_commands_total counter\nns_video_commands_total %llu\n",vid_commands);
+	fprintf(f,"# TYPE ns_video_commands_last_frame gauge\nns_video_commands_last_frame %u\n",vid_last_commands);
+	fprintf(f,"# TYPE ns_audio_underruns_total counter\nns_audio_underruns_total %llu\n",audio_underruns);
+	fprintf(f,"# TYPE ns_packets_received_total counter\nns_packets_received_total %llu\n",packets_received);
+	fprintf(f,"# TYPE ns_packets_sent_total counter\nns_packets_sent_total %llu\n",packets_sent);
+	fprintf(f,"# TYPE ns_packets_dropped_total counter\nns_packets_dropped_total %llu\n",packets_dropped);
+	fprintf(f,"# TYPE ns_dma_bytes_total counter\nns_dma_bytes_total %llu\n",moved);
+	fprintf(f,"# TYPE ns_ram_resident_bytes gauge\nns_ram_resident_bytes %llu\n",ram_rss);
+	fprintf(f,"# TYPE ns_flash_resident_bytes gauge\nns_flash_resident_bytes %llu\n",flash_rss);
+	fprintf(f,"# TYPE ns_telemetry_failed_total counter\nns_telemetry_failed_total %llu\n",telemetry_failed);
+	if (ferror(f) | fclose(f)) ++telemetry_failed;	// A client that hangs up early only
+}							// costs it its dump
+
+int telemetry_serve(void* data) {	// Telemetry thread.  It samples the clocks ten
+	struct pollfd p = { telemetry_fd, POLLIN, 0 };	// times a second, and answers
+	int fd;				// each connection with a dump of the counters.
+	while (running) {		// Nothing the cores do waits on it.
+		telemetry_sample();
+		if (poll(&p,1,100) > 0 && (fd = accept(telemetry_fd,NULL,NULL)) >= 0) telemetry_dump(fd);
+	}
+	return 0;
+}
+
+void telemetry_start() {		// Listen on the telemetry socket, replacing one
+	struct sockaddr_un a;		// left over from an earlier run.  Anything else
+	struct stat st;			// at that path is left alone, and bind fails.
+	memset(&a,0,sizeof(a));
+	a.sun_family = AF_UNIX;
+	strncpy(a.sun_path,telemetry_path,sizeof(a.sun_path) - 1);
+	if (!lstat(telemetry_path,&st) && S_ISSOCK(st.st_mode)) unlink(telemetry_path);
+	signal(SIGPIPE,SIG_IGN);	// A client hanging up fails the write, not the VM
+	telemetry_seen = calloc(headless ? instance_count : core_count,sizeof(cell));
+	telemetry_fd = socket(AF_UNIX,SOCK_STREAM,0);
+	if (!telemetry_seen || telemetry_fd < 0 || bind(telemetry_fd,(struct sockaddr*)&a,sizeof(a)))
+		exit(NO_TELEMETRY);
+	telemetry_made = 1;
+	if (listen(telemetry_fd,8)) {
+		unlink(telemetry_path);
+		exit(NO_TELEMETRY);
+	}
+	SDL_CreateThread(telemetry_serve,NULL);
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 // entry point
 int main (int argc, char** argv) {	//  Main Program Entry point
-	if (argc != 2) {
-		fprintf(stderr,"Usage: %s [file]\n",argv[0]);
+	int c, b = 0;
+	char* trace = NULL;		// Trace file to record or replay
+	cell replaying = 0;
+	while ((c = getopt(argc,argv,"c:bj:s:n:r:p:g:t:")) != -1) switch(c) {
+		case 'c': core_count = atoi(optarg); break;	// -c sets the number of guest cores
+		case 'b': b = 1; break;				// -b runs every file as a batch instance
+		case 'j': worker_count = atoi(optarg); break;	// -j sets the number of batch workers
+		case 's': slice_size = atoi(optarg); break;	// -s sets the ticks per time slice
+		case 'n': batch_ticks = atoi(optarg); break;	// -n sets the ticks each instance runs
+		case 'r': trace = optarg; replaying = 0; break;	// -r records input events to a trace
+		case 'p': trace = optarg; replaying = 1; break;	// -p plays a trace back as input
+		case 'g': profile_rate = atoi(optarg); break;	// -g samples ip this many times a second
+		case 't': telemetry_path = optarg; break;	// -t serves live counters on a socket
+		default: optind = argc; break;
+	}
+	if ((b ? optind >= argc : optind != argc - 1) || core_count < 1 || core_count > CORES || !slice_size
+	|| profile_rate > 1000000) {
+		fprintf(stderr,"Usage: %s [-c cores] [-r trace | -p trace] [-g hz] [-t socket] [file]\n"
+			"       %s -b [-j workers] [-s slice] [-n ticks] [-g hz] [-t socket] file[,trace]...\n",argv[0],argv[0]);
+		return 0;
+	}
+	if (b) {			// Batch mode runs headless, one instance per file
+		if (!worker_count) worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+		seteuid(getuid());	// Batch mode never uses the network, so it drops
+		batch_init(argv + optind,argc - optind);	// any setuid privileges first
+		if (telemetry_path) telemetry_start();
+		batch();
+		if (telemetry_made) unlink(telemetry_path);
 		return 0;
 	}
-	flash_file = argv[1];		// The user must specify a flash memory image
+	flash_file = argv[optind];	// The user must specify a flash memory image
+	cpu = &cores[0];		// The main thread simulates core 0.
+	cpu->replay = trace && replaying;	// (A replay skips the network's first read)
 	init();				// which we then boot to after initializing
+	if (trace) trace_open(cpu,trace,replaying);	// (once init has given up root)
 	reset();			// our various system attached devices.  The
 	boot();				// process of initializing and booting may
-	go();				// exit prematurely.  But if it all works, we
+	if (profile_rate) profile_start(flash,flash_size);
+	if (telemetry_path) telemetry_start();
+	start();			// exit prematurely.  But if it all works, we
 	return 0;			// simply start executing instruction 0 in 
 }					// the instruciton memory loaded from flash.
 
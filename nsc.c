@@ -19,6 +19,9 @@
 //
 ////////////////////////////////////////////////////////////////////////////////
 
+#define _XOPEN_SOURCE 700	// POSIX.1-2008 calls even under the Makefile's -std=c99,
+#define _DEFAULT_SOURCE		// plus mmap's MAP_FILE and MAP_ANONYMOUS on glibc
+#define _DARWIN_C_SOURCE	// and on OS X
 #include <stdlib.h>
 #include <stdio.h>
 #include <fcntl.h>
@@ -26,14 +29,34 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
-#define OPCODES		44
+#ifdef __APPLE__
+#define st_mtim st_mtimespec		// OS X's name for the nanosecond modification time
+#endif
+
+#define OPCODES		48
 #define IMAGE_SIZE	8388608
-#define STRINGS_OFFSET	2097152
-#define LEXICON_OFFSET	2017152
+#define STRINGS		20000		// (STRINGS_OFFSET - LEXICON_OFFSET) / 4 strings fit in the table
+#define STRING_HASH	32768		// Slots in the string hash, a power of 2 larger than STRINGS
+#define METHOD_HASH	131072		// Slots in the method hash, a power of 2
+#define MAX_IMAGE_MB	4095		// Largest image ns can map, in MB
+#define READ_SIZE	65536		// Size of reads from sources we can't map
+#define INDEX_MAGIC	0x5844494e	// "NIDX", first cell of an image's index file
+#define STAMP_CELLS	4		// Cells of the image's identity an index keeps
+#define HASH_SEED	2166136261u	// FNV-1a offset basis and prime, used by all our hashes
+#define HASH_PRIME	16777619
+#define UNIT_MAGIC	0x544e554e	// "NUNT", first cell of a compiled unit
+#define SERIAL_MAGIC	0x5245534e	// "NSER", first cell of a unit left to the link step
+#define EXTERNAL	0		// Object context of a unit's words that depend on other units
+
+#define note(level,...) do { if (verbose >= level) fprintf(stderr,__VA_ARGS__); } while (0)
 
 typedef unsigned int cell;
 
+#include "nsi.h"		// The image format, shared with ns
+
 // This character maps is used for translation from ASCII to the Firth character set which is more logical
 char char_map[] = "0123456789abcdefghijklmnopqrstuvwxyz,./;'[]\\`-= )!@#$%^&*(ABCDEFGHIJKLMNOPQRSTUVWXYZ<>?:\"{}|~_+\t\n";
 
@@ -50,6 +73,7 @@ struct {		// This table provides the system with a base list of opcodes for the
 	{ 0x98, "/" },  { 0x99, "!" },    { 0x9a, ">" },  { 0x9b, "~=" }, 
 	{ 0x9c, ">>" }, { 0x9d, ">>>" },  { 0x9e, "@u" }, { 0x9f, "-1" }, 
 	{ 0xa0, "<-" }, { 0xa1, "@#" },   { 0xa2, "@$" }, { 0xa3, "@%" }, 
+	{ 0xa4, "@i" }, { 0xa5, "+!" },   { 0xa6, "?!" }, { 0xa7, "wait" },
 	{ 0xc0, "==" }, { 0xc1, "#" },    { 0xc2, "$" },  { 0xc3, "%" }, 
 	{ 0xe0, "->" }, { 0xe1, "!#" },   { 0xe2, "!$" }, { 0xe3, "!%" }
 };
@@ -59,12 +83,138 @@ struct {		// This structure stores the translated opcode names and the associate
 	cell value;	// init_strings();  It is used by opcode() to find opcodes.  This allows
 } ops[OPCODES];		// us to bootstrap the system, without knowing about the Core object.
 
+cell keys[256];		// ASCII to Firth translation, built from char_map by init_keys()
+
+struct {		// Everything the compiler knows about a string, indexed by the string's
+	cell opcode;	// position in the strings table.  The opcode it names if any, and the
+	cell object;	// most recent object with that name, numbered from 1 with Core as 1.
+} symbols[STRINGS];
+
+cell string_hash[STRING_HASH];	// Open addressed hash of string addresses, keyed on their contents
+
+struct {		// Open addressed hash of methods, keyed on the object number and the 
+	cell object;	// method name's string address.  The address of the latest definition
+	cell ident;	// replaces the previous one, just as the newest method in the lexicon
+	cell addr;	// shadows older ones of the same name.
+	cell n;		// The method's position in its object, counting from 1 for the oldest
+} method_hash[METHOD_HASH];
+cell counts[LEXICON_OFFSET/2];	// Method count of each object, by number
+cell methods = 0;	// Number of methods in the method hash
+cell objects = 0;	// Number of objects
+cell latest = 0;	// The object define() adds to, the most recent unless we're recompiling
+cell visible = 0;	// The newest object find() can see, the most recent unless recompiling
+
+typedef struct {	// Each object is compiled from a chunk of source, running from the
+	cell name;	// word that names it to the word naming the next.  The prelude before
+	cell hash;	// the first is Core's chunk.  To recompile a chunk on its own, we keep
+	cell start;	// a hash of its words, the cells its code occupies, where its header
+	cell end;	// ended up, and the object that was current when it began.  Fixed
+	cell header;	// chunks can't be recompiled on their own, as their code shares a
+	cell entry;	// cell with their neighbour's, or they began after a comment.
+	cell fixed;
+} chunk;
+
+typedef struct {	// Every word compiled at the start of a line, and whether it began
+	cell word[4];	// an object.  An incremental build only goes ahead if these are
+	cell begins;	// unchanged, as they determine where the chunks are.
+} heading;
+
+typedef struct {	// Every method call compiled, so that calls can be repointed when
+	cell addr;	// the method they call is recompiled somewhere else.
+	cell object;
+	cell ident;
+} site;
+
+chunk* chunks = NULL;		// Chunks, by object number
+cell chunk_size = 0;
+cell chunk_hash = HASH_SEED;	// Hash of the words of the current chunk so far
+heading* headings = NULL;
+cell heading_count = 0, heading_size = 0;
+site* sites = NULL;
+cell site_count = 0, site_size = 0;
+
+cell rebuilding = 0;	// Object being recompiled by an incremental build, 0 if none
+cell stale = 0;		// Set when the recompiled object no longer matches its header
+cell* fresh = NULL;	// New addresses of the recompiled object's methods, by position
+cell home = 0;		// Where the recompiled code that will move to address 0 is compiled
+cell skipped = 0;	// Set when the current word came after a comment was skipped
+
+#define OP	0	// Kinds of item in the optimizer's buffer: an opcode, a constant,
+#define LIT	1	// or a method call
+#define CALL	2
+#define REF	3	// or a word left for the link step
+
+typedef struct {	// The optimizer buffers the code of each method as items, which
+	cell kind;	// are folded and rewritten as they arrive, and only laid out in
+	cell value;	// cells when the method ends.  A call keeps the object and name
+	cell object;	// of its method, for the call site index.  A ref keeps the ops
+	cell ident;	// that share its cell, which run or not depending on what the
+	cell ops;	// link step makes of it.
+} item;
+
+item* items = NULL;
+cell item_count = 0, item_size = 0;
+cell optimize = 0;	// Set by -O
+
+struct {		// Constants we can build from the 0, 1 and -1 opcodes and up to
+	cell value;	// two unary ops, which take fewer slots than a literal cell, need
+	cell n;		// no padding, and run in the same tick
+	unsigned char op[3];
+} constants[256];
+cell constant_count = 0;
+
+typedef struct {	// Every word a unit compiled by a -j worker couldn't resolve on its
+	cell addr;	// own, as it might name an object from an earlier source, or a
+	cell ident;	// method of one.  It gets a cell and an open slot after it, which
+	cell number;	// the link step fills with a call, a literal, or nops.  We keep
+	cell context;	// what find() and method() need to repeat the lookup then: the
+	cell latest;	// object current at the time, or EXTERNAL if that rests on the
+	cell count;	// ref before, the object being defined and its method count, and
+	cell visible;	// the newest object in sight.
+} ref;
+
+typedef struct {	// Names of objects begun and methods defined in each source, found
+	cell word[4];	// before the -j workers start, so a unit knows which of its words
+	cell source;	// could name an object or method in an earlier one, by depth: 0
+	cell depth;	// for an object, 1 for a method
+} name;
+
+ref* refs = NULL;
+cell ref_count = 0, ref_size = 0;
+name* names = NULL;
+cell name_count = 0, name_size = 0;
+cell* opens = NULL;	// Set for each source that begins a unit, with an object and a method
+cell unit = 0;		// First source compiled by a -j worker, counting from 1, 0 if not one
+cell tangled = 0;	// Set when a worker meets a name only the sources before it can settle
+cell jobs = 0;		// Number of -j workers
+cell packing = 0;	// Set by -z to write a chunked image
+
+cell plain_slot = 0;	// Where the code would be without -O, so we know which ops
+cell plain_dead = 0;	// would never run, and how big it would have been
+cell plain_cells = 0;
+cell cells = 0;		// Cells actually compiled under -O
+
 cell instr = 0;		// Pointer to currently compiling instruction cell
 cell slot = 0;		// Current slot 0,1,2,3 within the instruction cell
 
 cell* memory = NULL;			// Base address of the relocateable memory image, 0x80000000 in
-cell memory_size = IMAGE_SIZE;		// the VM, the size of the image produced determined by the 
-cell fd = -1;				// macros above.  The fd holds the OS filehandle on the image file.
+size_t memory_size = IMAGE_SIZE;	// the VM, the size of the image produced determined by the 
+cell fd = -1;				// macros above or -s.  The fd holds the OS filehandle on the image file.
+cell found[STAMP_CELLS];		// The image file as -i found it, before unpacking it
+
+cell verbose = 0;	// Diagnostics level, 0 errors, 1 objects and methods, 2 words, 3 keys
+
+char** sources = NULL;			// Source files to read, stdin if there are none
+cell source_count = 0;
+cell source_index = 0;			// Number of sources opened so far
+int source_fd = -1;			// The source being read, and its contents, either mapped
+unsigned char* source = NULL;		// in whole or the last READ_SIZE bytes read
+unsigned char* source_end = NULL;
+size_t source_size = 0;			// Size of the mapping, 0 if source points at read_buffer
+unsigned char read_buffer[READ_SIZE];
+unsigned char* text = NULL;		// All of the source, when building incrementally
+size_t text_size = 0;
+unsigned char* word_start = NULL;	// Where in text the current word began
 
 cell lexicon_end = LEXICON_OFFSET;	// Top address in the lexicon, minimum string address
 cell lexicon = LEXICON_OFFSET;		// This is the current address in the lexicon, grows down.
@@ -80,23 +230,59 @@ cell input_index = 0;	// no more than 16 characters total, hence input_index is
 cell input_slot = 0;	// similarly, input_slot is either 0,1,2,3 representing the byte at input[input_index]
 cell line = 0;		// The line is a 4 mode, 0 = Object 1 = verb 2 = code 3 = comment line descriptor
 
-cell object;	// current active object, this is used to look up method names
+cell object;	// current active object number, this is used to look up method names
 cell ident;	// identity of active element, holds the string pointer to the string we are looking for
 
 cell keymap(int c) {	
-	for (cell i = 0; i < sizeof(char_map); ++i)	// We walk through the character map and
-		if (char_map[i] == c) return i;		// if we find a matching character return its index
-	return 0x66;					// Otherwise we return 0x66, the unknown character
+	return c < 0 || c > 255 ? 0x66 : keys[c];	// EOF is 0x66, the unknown character
 }
 
 cell space() {
 	if (key == 0x5f) ++line;					// increment line for each tab
-	fprintf(stderr,"Key is %p Line is %d\n",key,line);
+	note(3,"Key is %p Line is %d\n",key,line);
 	if (key == 0x2f || key == 0x5f || key == 0x60) return -1;	// space, tab, newline
 	return 0;							// all other characters
 }
 
-cell inkey() { return key = keymap(getchar()); }
+int open_source() {				// Opens the next source file, and maps it in
+	struct stat st;				// whole if it can, otherwise next_char() will
+	if (source_size) munmap(source,source_size);	// read it in READ_SIZE chunks.
+	if (source_fd > 0) close(source_fd);	// Returns 0 when there are none left.
+	source = source_end = NULL;
+	source_size = 0;
+	source_fd = -1;
+	if (source_index >= (source_count ? source_count : 1)) return 0;
+	if (!source_count) return ++source_index, source_fd = 0, 1;	// no files, read stdin
+	note(1,"Reading Source: %s\n",sources[source_index]);
+	if ((source_fd = open(sources[source_index],O_RDONLY)) < 0) {
+		fprintf(stderr,"Can not read %s\n",sources[source_index]);
+		exit(5);
+	}
+	++source_index;
+	if (!fstat(source_fd,&st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+		source = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE|MAP_FILE,source_fd,0);
+		if (source == MAP_FAILED) source = NULL;
+		else source_end = source + (source_size = st.st_size);
+	}
+	return 1;
+}
+
+int next_char() {				// Returns the next character of source, or EOF.
+	ssize_t n;				// Sources are read one after another, with a
+	while (source == source_end) {		// newline between them so that the last word
+		if (source_fd >= 0 && !source_size	// of one file never runs into the first
+		&& (n = read(source_fd,read_buffer,READ_SIZE)) > 0) {	// word of the next.
+			source = read_buffer;
+			source_end = read_buffer + n;
+			continue;
+		}
+		if (!open_source()) return EOF;
+		if (source_index > 1) return '\n';
+	}
+	return *source++;
+}
+
+cell inkey() { return key = keymap(next_char()); }
 
 cell word() {
 	memset(input,0xff,4*sizeof(cell));	// Word parses the values from stdin, into separate words
@@ -106,6 +292,7 @@ cell word() {
 						// The input buffer is filled in 1 byte at a time until the
 	while (0x66 != inkey()) {		// character 0x66 is encountered
 		if (space()) return -1;				// A word is done if a space is encountered
+		if (!input_index && !input_slot) word_start = source - 1;
 		input[input_index] <<= 8;			// and stored in the String table in MSB order
 		input[input_index] |= (0xff & key);		// the last character is stored in the LSB
 		if (0x33 == key) hex = 1;			// and we always calculate the numeric value
@@ -113,28 +300,82 @@ cell word() {
 		++input_slot;					// # prefixes hexidecimal numbers, 
 		if ((input_slot &= 3) == 0) ++input_index;	 
 	}							// If we get the  unknown character
-	return 0;						// from stdin, it means getchar() -> EOF
+	return 0;						// from the source, it means EOF
 }
 
-cell dump() {
-	unsigned char* str = (unsigned char*)&memory[ident];
-	for (cell i = 0; i < 16 && (*(str+i) != 0xff); ++i)
-		fprintf(stderr,"%c",char_map[*(str+i)]);
+char* dump() {
+	static char str[17];				// Translates ident's string back to ASCII 
+	char* s = str;					// for diagnostics.  Characters are stored
+	for (cell i = 0; i < 16; ++i) {			// MSB first and padded with #ff
+		cell c = (memory[ident + i/4] >> (24 - 8*(i&3))) & 0xff;
+		if (c < sizeof(char_map) - 1) *s++ = char_map[c];
+	}
+	*s = '\0';
+	return str;
+}
+
+cell symbol(cell i) {
+	return (strings_end - i) / 4 - 1;		// Index of a string in the symbols table
+}
+
+cell string_slot(cell* str) {
+	cell h = HASH_SEED, i;				// Finds a string's slot in the string hash
+	for (cell j = 0; j < 4; ++j)			// or the empty slot where it goes
+		h = (h ^ str[j]) * HASH_PRIME;
+	for (h &= STRING_HASH - 1; (i = string_hash[h]); h = (h + 1) & (STRING_HASH - 1))
+		if (!memcmp(&memory[i],str,4*sizeof(cell))) break;
+	return h;
 }
 
 cell string() {
+	cell h;
 	if (!input_index  && ! input_slot) return 0;	// If the string is empty return 0
-	for (cell i = strings; i < strings_end; i+=4)	// This function looks up the input buffer's
-		if (memory[i] == input[0] 		// value in the string table, and returns the
-		&& memory[i+1] == input[1] 		// applicable index if found, otherwise
-		&& memory[i+2] == input[2] 		// it will allocate 16bytes in the strings table
-		&& memory[i+3] == input[3]) return i;	// and place a copy of the input buffer there
-	strings -= 4;					// which means that each string in the source 
-	memcpy(&memory[strings],input,sizeof(cell)*4);	// will appear only once in the image file
-	return strings;					// We can use these strings for any purpose.
+	h = string_slot(input);				// This function looks up the input buffer's
+	if (string_hash[h]) return string_hash[h];	// value in the string hash, and returns the
+	if (symbol(strings - 4) >= STRINGS) {		// applicable index if found, otherwise
+		fprintf(stderr,"Too many strings\n");	// it will allocate 16bytes in the strings table
+		exit(3);				// and place a copy of the input buffer there
+	}						// which means that each string in the source 
+	strings -= 4;					// will appear only once in the image file
+	memcpy(&memory[strings],input,sizeof(cell)*4);	// We can use these strings for any purpose.
+	return string_hash[h] = strings;
+}
+
+void* grow(void* p, cell* size, cell need, size_t item) {	// Grows a table to hold at
+	if (need <= *size) return p;		// least need items, doubling it each time
+	while (*size < need) *size = *size ? *size * 2 : 1024;
+	if (!(p = realloc(p,*size * item))) exit(6);
+	return p;
+}
+
+cell mix(cell h) {
+	if (!input_index && !input_slot) return h;	// Adds the current word, its depth
+	for (cell j = 0; j < 4; ++j)		// and the key that ended it to a chunk
+		h = (h ^ input[j]) * HASH_PRIME;	// hash.  Empty words only count tabs
+	h = (h ^ line) * HASH_PRIME;		// towards the depth of the next, and
+	return (h ^ key) * HASH_PRIME;		// comments are skipped, so blank lines,
+}						// spacing and comments never change it
+
+void close_chunk() {
+	chunk* c = &chunks[objects];		// Records where the most recent object's
+	c->end = instr + (slot ? 1 : 0);	// code and header ended up
+	c->header = lexicon;
+	c->hash = chunk_hash;
+}
+
+void open_chunk(cell n) {
+	chunk* c;				// Starts the chunk for a new object, whose
+	chunks = grow(chunks,&chunk_size,n + 2,sizeof(chunk));	// code begins in the
+	c = &chunks[n];				// next whole cell
+	c->name = ident;
+	c->start = instr + (slot ? 1 : 0);
+	c->entry = object;
+	c->fixed = skipped;
 }
 
 void byte(cell c) {
+	if (instr < chunks[objects].start && c != 0x80)	// Code sharing a cell with the last
+		chunks[objects].fixed = chunks[objects-1].fixed = 1;	// object's pins both
 	memory[instr] |= ((c&0xff) << (8*slot));	// This function will compile one byte to the
 	++slot;						// begining of instruction memory.  It will 
 	if ((slot &= 3) == 0) ++instr;			// switch cells on slot overflow.
@@ -144,57 +385,284 @@ void pad() {
 	while (slot) byte(0x80);		// Pad is used to align to a cell boundary, writes nops
 }
 
-cell begin() {		
+////////////////////////////////////////////////////////////////////////////////
+// optimizer
+
+void init_constants() {				// Finds every constant 0, 1 or -1 followed by
+	unsigned char unary[] = { 0x85, 0x95, 0x8c, 0x8d, 0x9c, 0x9d };	// up to two of
+	cell seeds[] = { 0x8e, 0, 0x8f, 1, 0x9f, -1 };			// ~ - << <<< >> >>>
+	for (cell i = 0; i < 3; ++i) {		// can make, shortest first
+		constants[i].value = seeds[2*i+1];
+		constants[i].n = 1;
+		constants[i].op[0] = seeds[2*i];
+	}
+	constant_count = 3;
+	for (cell i = 0; i < constant_count; ++i) {
+		if (constants[i].n == 3) continue;
+		for (cell j = 0; j < sizeof(unary); ++j) {
+			cell v = constants[i].value, k;
+			switch (unary[j]) {
+				case 0x85: v = ~v; break;
+				case 0x95: v = -v; break;
+				case 0x8c: v <<= 1; break;
+				case 0x8d: v <<= 8; break;
+				case 0x9c: v >>= 1; break;
+				case 0x9d: v >>= 8; break;
+			}
+			for (k = 0; k < constant_count && constants[k].value != v; ++k);
+			if (k < constant_count) continue;
+			constants[k] = constants[i];
+			constants[k].value = v;
+			constants[k].op[constants[k].n++] = unary[j];
+			++constant_count;
+		}
+	}
+}
+
+void plain_op(cell op) {			// Follows where an op would be placed without
+	if (!plain_slot) {			// -O.  An op sharing a cell with an earlier call
+		++plain_cells;			// or jump never runs, as those go on to the
+		plain_dead = 0;			// next cell
+	}
+	if (op == 0x81 || op == 0x90) plain_dead = 1;
+	plain_slot = (plain_slot + 1) & 3;
+}
+
+void plain_pad() {
+	plain_slot = 0;
+}
+
+cell fold(cell op, cell a, cell b, cell* v) {	// Works out op on constants, a below b,
+	switch (op) {				// if it can be folded into one constant
+		case 0x86: *v = a & b; return 2;
+		case 0x87: *v = a | b; return 2;
+		case 0x88: *v = a ^ b; return 2;
+		case 0x96: *v = a + b; return 2;
+		case 0x83: *v = b; return 2;	// nip
+		case 0x85: *v = ~b; return 1;
+		case 0x95: *v = -b; return 1;
+		case 0x8c: *v = b << 1; return 1;
+		case 0x8d: *v = b << 8; return 1;
+		case 0x9c: *v = b >> 1; return 1;
+		case 0x9d: *v = b >> 8; return 1;
+	}
+	return 0;
+}
+
+cell cancels(cell a, cell b) {			// Pairs of ops that undo each other: dup drop,
+	return (a == 0x92 && b == 0x82) || (a == 0x95 && b == 0x95)	// neg neg, not not,
+		|| (a == 0x85 && b == 0x85) || (a == 0x84 && b == 0x94)	// push pop, and dup nip
+		|| (a == 0x92 && b == 0x83);
+}
+
+void item_add(cell kind, cell value) {		// Buffers an item, then folds the end of the
+	item* t;				// buffer for as long as it can.  Ops that
+	cell v, n;				// would never run are dropped.
+	if (kind == OP) {
+		cell dead = plain_dead && plain_slot, at = plain_slot;
+		plain_op(value);
+		if (dead) return;
+		if (at && item_count && items[item_count - 1].kind == REF) {
+			items[item_count - 1].ops |= value << 8*(at - 1);
+			return;
+		}
+		if (value == 0x8e || value == 0x8f || value == 0x9f) {
+			kind = LIT;		// 0, 1 and -1 are constants like any other
+			value = value == 0x8e ? 0 : value == 0x8f ? 1 : -1;
+		}
+	} else {
+		plain_pad();
+		++plain_cells;
+		if (kind == CALL) plain_op(0x81);
+		else if (kind == REF) plain_op(0x80);
+		else if (value & 0x80000000) plain_op(0x95);
+	}
+	items = grow(items,&item_size,item_count + 1,sizeof(item));
+	items[item_count++] = (item){ kind, value, object, ident };
+	while (item_count > 1) {
+		t = &items[item_count - 1];
+		if (t[-1].kind == OP && t[0].kind == OP && cancels(t[-1].value,t[0].value)) {
+			item_count -= 2;
+		} else if (t[0].kind == OP && t[-1].kind == LIT && t[0].value == 0x82) {
+			item_count -= 2;	// a constant dropped
+		} else if (t[0].kind == OP && t[-1].kind == LIT
+		&& (n = fold(t[0].value,item_count > 2 ? t[-2].value : 0,t[-1].value,&v))
+		&& (n == 1 || (item_count > 2 && t[-2].kind == LIT))) {
+			item_count -= n;
+			items[item_count - 1] = (item){ LIT, v };
+		} else break;
+	}
+}
+
+void constant(cell v) {				// Lays out a constant as ops if it can be
+	for (cell i = 0; i < constant_count; ++i)	// made in 3 or fewer, otherwise as
+		if (constants[i].value == v) {		// a literal cell
+			for (cell j = 0; j < constants[i].n; ++j) {
+				if (!slot) ++cells;
+				byte(constants[i].op[j]);
+			}
+			return;
+		}
+	pad();
+	++cells;
+	memory[instr++] = v & 0x80000000 ? -v & 0x7fffffff : v;
+	if (v & 0x80000000) {
+		++cells;
+		byte(0x95);
+	}
+}
+
+void flush() {					// Lays out the buffered items.  Calls and
+	for (cell i = 0; i < item_count; ++i) {	// jumps end their cell, as the rest of
+		item* t = &items[i];		// it would be skipped.
+		switch (t->kind) {
+			case LIT: constant(t->value); break;
+			case REF:
+				pad();
+				refs[t->value].addr = instr;
+				cells += 2;
+				memory[instr++] = 0;
+				byte(0x80);
+				for (cell v = t->ops; v; v >>= 8) byte(v & 0xff);
+				pad();
+				break;
+			case CALL:
+				pad();
+				sites = grow(sites,&site_size,site_count + 1,sizeof(site));
+				sites[site_count++] = (site){ instr, t->object, t->ident };
+				cells += 2;
+				memory[instr++] = t->value;
+				byte(0x81);
+				pad();
+				break;
+			default:
+				if (!slot) ++cells;
+				byte(t->value);
+				if (t->value == 0x81 || t->value == 0x90) pad();
+		}
+	}
+	item_count = 0;
+}
+
+void begin() {		
+	if (rebuilding) {		// When recompiling an object, its name is the first
+		if (visible == rebuilding || ident != chunks[rebuilding].name) stale = 1;	// word,
+		object = visible = rebuilding;	// and everything else about it is already in
+		counts[object] = 0;		// the lexicon.  We forget its methods, and
+		return;				// define() checks them off as they come back.
+	}
+	flush();
+	close_chunk();
+	open_chunk(objects + 1);
+	chunk_hash = mix(HASH_SEED);	// the name is the first word of the new chunk
+	headings[heading_count-1].begins = 1;
 	memory[--lexicon] = 0;	// with no tabs at the begining and a word starting with a capital letter
 	memory[--lexicon] = ident;	// we save the value of that line for later writing to the lexicon
-	object = lexicon;		// and initialize the current object to this object
-	fprintf(stderr,"Compiling object ");
-	dump();
-	fprintf(stderr,"\n");
+	object = latest = visible = symbols[symbol(ident)].object = ++objects;	// and make this
+	note(1,"Compiling object %s\n",dump());				// the current object
+}
+
+int earlier(cell depth) {			// Tells if the current word names an object
+	cell lo = 0, hi = name_count;		// begun in a source before this unit's, or
+	while (lo < hi) {			// at depth 1 a method defined in one
+		cell mid = (lo + hi) / 2;
+		int d = memcmp(names[mid].word,input,sizeof(input));
+		if (d < 0) lo = mid + 1;
+		else hi = mid;
+	}
+	for (; lo < name_count && !memcmp(names[lo].word,input,sizeof(input)) && names[lo].source < unit; ++lo)
+		if (names[lo].depth <= depth) return 1;
+	return 0;
 }
 
 cell find() {						// Find uses the object names set by begin/end
-	for (int i = lexicon; i < lexicon_end;) {	// to locate the current set of slots in which
-		if (memory[i] == ident) return object = i;	// a method may be found.  Using an object's
-		i += ((memory[i+1]<<1)+2);		// name switches which current method buffer is
-	}						// queried at compile time.
-	return 0;					// if no object is found, then 
+	cell i = symbols[symbol(ident)].object;		// to locate the current set of slots in which
+	if (i > visible)				// a method may be found.  Using an object's
+		for (i = visible; i && chunks[i].name != ident; --i);	// name switches which
+	if (object == EXTERNAL && earlier(1)) return 0;	// current method buffer is queried
+	return i ? object = i : 0;			// at compile time.  Objects newer than the
+}							// one being recompiled are out of sight, and
+							// a unit can't look past a word it left to
+							// the link step that may be a method.
+
+cell method_slot(cell o, cell i) {			// Finds the method hash slot for a method of
+	cell h = (o * 16777619) ^ (i * 2654435761u);	// an object, or the empty slot where it goes.
+	for (h &= METHOD_HASH - 1; method_hash[h].object; h = (h + 1) & (METHOD_HASH - 1))
+		if (method_hash[h].object == o && method_hash[h].ident == i) break;
+	return h;
+}
+
+void add_method(cell o, cell i, cell addr) {		// Adds a method to the hash, or replaces
+	cell h = method_slot(o,i);			// an older definition of the same name.
+	cell n = ++counts[o];
+	if (!method_hash[h].object && ++methods > METHOD_HASH - METHOD_HASH/4) {
+		fprintf(stderr,"Too many methods\n");
+		exit(4);
+	}
+	method_hash[h].object = o;
+	method_hash[h].ident = i;
+	method_hash[h].addr = addr;
+	method_hash[h].n = n;
 }
 
 void define() {			
+	flush();					// (Any code buffered by the optimizer is
+	plain_pad();					// laid out first.)
 	pad();						// To define a new method, we copy down the 
-	lexicon -= 2;					// object's header, incrementing the method count
-	memory[lexicon] = memory[lexicon+2];		// and then set the method name and address
-	memory[lexicon+1] = memory[lexicon+3]+1;	// after padding to the next full cell address
-	memory[lexicon+2] = ident;
-	memory[lexicon+3] = instr;
-	object = lexicon;				// Finally we reset the current object to here!
-	fprintf(stderr,"Defining method ["); dump(); fprintf(stderr,"]\n");
+	if (rebuilding) {				// object's header, incrementing the method count
+		cell h = chunks[latest].header;		// and then set the method name and address
+		cell n = counts[latest] + 1;		// after padding to the next full cell address
+		if (n > memory[h+1] || memory[h + 2*(memory[h+1] - n) + 2] != ident) stale = 1;
+		else fresh[n] = instr;			// When recompiling, the methods must come
+	} else {					// back in the same order, and the header is
+		lexicon -= 2;				// patched once we know where the code goes.
+		memory[lexicon] = memory[lexicon+2];
+		memory[lexicon+1] = memory[lexicon+3]+1;
+		memory[lexicon+2] = ident;
+		memory[lexicon+3] = instr;
+	}
+	add_method(latest,ident,instr);			// Finally we reset the current object to
+	object = latest;				// the one we're defining!
+	note(1,"Defining method [%s]\n",dump());
 }
 
 cell method() {						// This finds a method in an object
-	for (int i = 0; i < memory[object+1]; i += 2)	// We run 2 cells at a time, name=addr
-		if (memory[object+i+2] == ident)	// If we find the current ident, return addr
-			return memory[object+i+3];		
-	return 0;					// Otherwise return 0
-}
+	cell h = method_slot(object,ident);		// or returns 0 if it has none.  The lexicon
+	cell count = counts[object];			// scan this replaces stepped 2 cells at a
+	if (!method_hash[h].object || method_hash[h].n > count) return 0;	// time but stopped at
+							// the method count, so
+	if (2 * (count - method_hash[h].n) >= count) return 0;	// only the newest half of an
+	if (method_hash[h].addr == home) return 0;	// object's methods are found.  We keep that
+	return method_hash[h].addr;			// so the images we produce don't change.
+}							// A method at address 0 can't be called, so
+							// it is compiled as a literal, even while it
+							// is being recompiled somewhere else.
 
 void function() {			// Compiles a function call
+	if (optimize) {			// or buffers it under -O
+		item_add(CALL,method());
+		return;
+	}
 	pad();				// pad to current address so we can compile a literal
+	sites = grow(sites,&site_size,site_count + 1,sizeof(site));	// note the call site
+	sites[site_count++] = (site){ instr, object, ident };
 	memory[instr++] = method();	// compile the literal address of the method
 	byte(0x81);			// write the call opcode
 }
 
 cell opcode() {
-	for (int i = 0; i < OPCODES; ++i)		// For each opcode
-		if (ops[i].key == ident) { 		// if the opcode's key == ident
-			fprintf(stderr,"Compiling opcode %d\n",ops[i].value);
-			return ops[i].value;		// return the opcode value
-		}
-	return 0;					// or 0 if not an opcode
+	cell op = symbols[symbol(ident)].opcode;	// Look up the opcode named by ident
+	if (op) note(2,"Compiling opcode %d\n",op);
+	return op;					// or 0 if not an opcode
 }
 
+void item_add(cell kind, cell value);
+
 void literal() {
+	if (optimize) {					// Under -O the literal's value is buffered
+		item_add(LIT,number & 0x80000000 ? -(-number & 0x7fffffff) : number & 0x7fffffff);
+		return;
+	}
 	pad();						// Pad with nops to current cell boundary
 	memory[instr++] = number & 0x80000000 ? 	// if the literal is negative
 		-number & 0x7fffffff: 			// compile the positive value
@@ -202,17 +670,48 @@ void literal() {
 	if (number&0x80000000) byte(0x95);		// for negative number compile a negate opcode
 }
 
+cell dead() {					// Tells if an op laid out now would share
+	if (optimize) return plain_dead && plain_slot;	// a cell with a call or jump
+	for (cell j = 0; j < slot; ++j) {	// before it, and so never run
+		cell op = memory[instr] >> 8*j & 0xff;
+		if (op == 0x81 || op == 0x90) return 1;
+	}
+	return 0;
+}
+
+void refer() {					// Leaves a word for the link step to resolve,
+	refs = grow(refs,&ref_size,ref_count + 1,sizeof(ref));	// and everything after
+	refs[ref_count] = (ref){ 0, ident, number, object, latest, counts[latest], objects };	// it
+	object = EXTERNAL;			// that may be a method, as it might have
+	if (dead()) tangled = 1;		// switched objects.  A ref can't stay in a
+	if (optimize) {				// cell a call has ended, as a word naming
+		item_add(REF,ref_count++);	// an object would, so that unit is left to
+		return;				// the link step.
+	}
+	pad();
+	refs[ref_count++].addr = instr;
+	memory[instr++] = 0;
+	byte(0x80);
+}
+
 void skip() { 
-	while(0x60 != inkey()); 
+	while(0x60 != inkey() && 0x66 != key);	// a comment may end the source
 	line = 0;
 }
 
+void tangle() {					// A unit whose worker would begin an
+	if (unit && earlier(object == EXTERNAL)) tangled = 1;	// object or define a
+}						// method where an earlier source's object
+						// or method might be found is compiled by
+						// the link step instead
+
 void unknown() {
-	fprintf(stderr,"%d >> unknown word [",line); dump(); fprintf(stderr,"]\n");
+	note(2,"%d >> unknown word [%s]\n",line,dump());
 	switch(line) {					// Unknown at start of the line are
-		case 0: begin(); break;			// names of objects, while unknown
-		case 1: define(); break;		// one tab in are verbs, otherwise
-		case 2: literal(); break;		// we compile a number literal or
+		case 0: tangle(); begin(); break;	// names of objects, while unknown
+		case 1: tangle(); define(); break;	// one tab in are verbs, otherwise
+		case 2: unit && earlier(object == EXTERNAL) ?
+			refer() : literal(); break;	// we compile a number literal or
 		default: skip(); break;			// 3 tabs skip comment to end of line
 	}
 } 
@@ -221,28 +720,34 @@ void nop() {}
 
 void compile() {
 	while(word()) {				// For each word in input
+		chunk_hash = mix(chunk_hash);	// Hash each word into the object's chunk
+		skipped = line > 2;
 		if (line > 2) skip();		// Skip to end of line if we are in a comment
 		ident = string();		// Find string identity
 		if (ident == 0) continue;	// If it is an empty string continue
-		fprintf(stderr,"found string ["); dump(); fprintf(stderr,"]\n");
-		opcode() ? byte(opcode()): 	// If opcode compile it otherwise
+		note(2,"found string [%s]\n",dump());
+		if (!line && !rebuilding) {	// Note each word at the start of a line
+			headings = grow(headings,&heading_size,heading_count + 1,sizeof(heading));
+			memcpy(headings[heading_count].word,input,sizeof(input));
+			headings[heading_count++].begins = 0;
+		}
+		cell op = opcode();		// Look the word up as an opcode just once
+		op ? optimize ? item_add(OP,op) : byte(op):	// If opcode compile it
 		method() ? function():		// Else see if it is a method, and compile a function call
 		find() ? nop() : unknown();	// Otherwise see if it is an object, or unknown
 		if (key == 0x60) line = 0;	// reset line on newline
 	}
+	flush();				// and lay out any code left buffered
 }
 
 void init_memory(const char* filename) {
-	cell buffer[4096];
-	memset(buffer,0,sizeof(buffer));
-	fd = open(filename,O_CREAT|O_RDWR,0600);
-	if (fd < 0) exit(1);
-	fprintf(stderr,"Creating Image: %s\n", filename);
-	for(int i = 0; i < memory_size/sizeof(buffer); ++i) 
-		write(fd,&buffer,sizeof(buffer));
-	fprintf(stderr,"Created Image: %s\n",filename);
+	fd = open(filename,O_CREAT|O_RDWR,0600);	// Truncating the image and then
+	if (fd < 0) exit(1);				// extending it gives us a sparse
+	note(1,"Creating Image: %s\n", filename);	// file of zeros, without writing
+	if (ftruncate(fd,0) || ftruncate(fd,memory_size)) exit(1);	// any of them
+	note(1,"Created Image: %s\n",filename);
 	memory = mmap(NULL,memory_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_FILE,fd,0);
-	if (memory < 0) exit(2);
+	if (memory == MAP_FAILED) exit(2);
 }
 
 void load_string(const char* str) {
@@ -261,33 +766,639 @@ void init_strings() {
 		load_string(opcodes[i].name);		// copy the string into the input buffer
 		ops[i].key = string();			// Then initialize the ops table
 		ops[i].value = opcodes[i].opcode;	// with the correct targe values
+		symbols[symbol(ops[i].key)].opcode = ops[i].value;
 	}
 }
 
 void init_lexicon() {
+	object = ++objects;				// Core is object 1
 	for (int i = 0; i < OPCODES; ++i) {		// For each opcode we compile a simple definition
 		memory[--lexicon] = ops[i].value;	// which will form the basis for the Core Object
 		memory[--lexicon] = ops[i].key;		// In the native compiler, we'll use these as lits
+		add_method(object,ops[i].key,ops[i].value);
 	}
 	load_string("Core");				// We can load the string "Core" for the core
 	memory[--lexicon] = OPCODES;			// Object, but we never use this with find
 	memory[--lexicon] = string(); 			// it is just a tool for debugging
+	symbols[symbol(memory[lexicon])].object = latest = visible = object;
+	ident = memory[lexicon];			// The prelude is Core's chunk, it can't
+	skipped = 1;					// be recompiled on its own
+	open_chunk(object);
+}
+
+void init_keys() {
+	for (int i = 0; i < 256; ++i) keys[i] = 0x66;	// Everything not in the character map is
+	for (int i = sizeof(char_map) - 1; i >= 0; --i)	// unknown, and the first match in the map
+		keys[0xff & char_map[i]] = i;		// wins, so we fill it in backwards
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// incremental builds
+
+void load_text() {				// Reads all of the sources into one buffer,
+	size_t size = 0;			// so chunks can be compiled out of order
+	int c;
+	while ((c = next_char()) != EOF) {
+		if (text_size == size) text = realloc(text,size = size ? size * 2 : READ_SIZE);
+		if (!text) exit(6);
+		text[text_size++] = c;
+	}
+	source = text;
+	source_end = text + text_size;
+}
+
+void image_stamp(const char* image, cell* stamp) {	// Identifies the image file by
+	struct stat st;				// its size, inode and modification time, so
+	memset(stamp,0,STAMP_CELLS * sizeof(cell));	// an index is only used with the
+	if (stat(image,&st)) return;		// image it was written beside, without
+	stamp[0] = st.st_size;			// reading the image.  Anything else writing
+	stamp[1] = st.st_ino;			// it, ns included, changes the time, and
+	stamp[2] = st.st_mtime;			// packing it or saving a chunked image
+	stamp[3] = st.st_mtim.tv_nsec;		// replaces the file.
+}
+
+void save_index(const char* image) {		// Writes the index of chunks, line headings
+	char file[1024];			// and call sites next to the image, once the
+	FILE* f;				// image is written and closed
+	cell head[11 + STAMP_CELLS] = { INDEX_MAGIC, memory_size >> 20, OPCODES, instr, slot,
+		lexicon, strings, objects, object, heading_count, site_count };
+	image_stamp(image,head + 11);
+	snprintf(file,sizeof(file),"%s.idx",image);
+	if (!(f = fopen(file,"w"))) {
+		fprintf(stderr,"Can not write %s\n",file);
+		return;
+	}
+	fwrite(head,sizeof(head),1,f);
+	fwrite(chunks + 1,sizeof(chunk),objects,f);
+	fwrite(headings,sizeof(heading),heading_count,f);
+	fwrite(sites,sizeof(site),site_count,f);
+	fclose(f);
+}
+
+void drop_index(const char* image) {		// Removes the index of an image built from
+	char file[1024];			// scratch, which no longer describes it
+	snprintf(file,sizeof(file),"%s.idx",image);
+	unlink(file);
+}
+
+cell load_index(const char* image) {		// Reads the index, and checks it matches
+	char file[1024];			// the image as it was found, before any
+	struct stat st;				// unpacking, and this nsc's opcodes
+	FILE* f;
+	cell head[11 + STAMP_CELLS], ok;
+	snprintf(file,sizeof(file),"%s.idx",image);
+	if (!(f = fopen(file,"r"))) return 0;
+	ok = fread(head,sizeof(head),1,f) == 1 && head[0] == INDEX_MAGIC && head[1] == memory_size >> 20
+		&& head[2] == OPCODES && !memcmp(head + 11,found,sizeof(found))
+		&& !fstat(fd,&st) && st.st_size == memory_size;
+	if (ok) {
+		memory = mmap(NULL,memory_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_FILE,fd,0);
+		if (memory == MAP_FAILED) exit(2);
+		instr = head[3]; slot = head[4]; lexicon = head[5]; strings = head[6];
+		objects = head[7]; object = head[8]; heading_count = head[9]; site_count = head[10];
+		chunks = grow(chunks,&chunk_size,objects + 2,sizeof(chunk));
+		headings = grow(headings,&heading_size,heading_count + 1,sizeof(heading));
+		sites = grow(sites,&site_size,site_count + 1,sizeof(site));
+		ok = fread(chunks + 1,sizeof(chunk),objects,f) == objects
+			&& fread(headings,sizeof(heading),heading_count,f) == heading_count
+			&& fread(sites,sizeof(site),site_count,f) == site_count;
+	}
+	fclose(f);
+	return ok;
+}
+
+void reload() {					// Rebuilds the compiler's tables from the
+	for (cell i = strings; i < strings_end; i += 4)	// image's strings and lexicon
+		string_hash[string_slot(&memory[i])] = i;
+	init_strings();
+	for (cell n = 1; n <= objects; ++n) {
+		cell h = chunks[n].header;
+		symbols[symbol(memory[h])].object = n;
+		for (cell j = memory[h+1]; j; --j)	// oldest method first
+			add_method(n,memory[h + 2*j],memory[h + 2*j + 1]);
+	}
+	latest = visible = objects;
+}
+
+unsigned char* scan(unsigned char** origin, cell* dirty) {
+	cell n = 0, k = 1, prev;		// Splits the source into chunks, following
+	line = 0;				// the same rules as compile(), and compares
+	chunk_hash = HASH_SEED;			// their hashes.  Returns where any new source
+	source = text;				// after the last chunk begins, the end of the
+	source_end = text + text_size;
+	while (word()) {			// text if there is none, or NULL if chunks
+		prev = chunk_hash;		// came or went and we must start over.
+		chunk_hash = mix(chunk_hash);
+		skipped = line > 2;
+		if (line > 2) skip();
+		if (!input_index && !input_slot) continue;
+		if (!line) {
+			if (n == heading_count) {	// new source follows the last chunk
+				dirty[k] = chunks[k].hash != prev;
+				chunks[k].hash = chunk_hash = prev;
+				return skipped ? NULL : word_start;
+			}
+			if (memcmp(headings[n].word,input,sizeof(input))) return NULL;
+			if (headings[n++].begins) {
+				dirty[k] = chunks[k].hash != chunk_hash;
+				chunks[k].hash = chunk_hash;
+				origin[++k] = word_start;
+				chunk_hash = mix(HASH_SEED);
+			}
+		}
+		if (key == 0x60) line = 0;
+	}
+	if (n != heading_count) return NULL;
+	dirty[k] = chunks[k].hash != chunk_hash;
+	chunks[k].hash = chunk_hash;
+	return text + text_size;
+}
+
+void relocate(cell k, cell from, cell to, cell size, cell first) {
+	cell delta = to - from, h = chunks[k].header, total = memory[h+1], j = 0;
+	memmove(&memory[to],&memory[from],size * sizeof(cell));	// Moves freshly compiled
+	if (to != from) memset(&memory[from],0,size * sizeof(cell));	// code into place,
+	for (cell i = 0; i < site_count; ++i) {	// drops the call sites in the old code, and
+		site s = sites[i];		// moves the new ones with it.
+		if (i < first && s.addr >= chunks[k].start && s.addr < chunks[k].end) continue;
+		if (i >= first) {
+			s.addr += delta;
+			if (memory[s.addr] >= from && memory[s.addr] < from + size) memory[s.addr] += delta;
+		} else if (s.object == k)	// Calls from elsewhere to the old methods
+			for (cell n = 1; n <= total; ++n)	// now go to the new ones
+				if (memory[h + 2*n] == s.ident && memory[h + 2*n + 1] == memory[s.addr]) {
+					memory[s.addr] = fresh[total - n + 1] + delta;
+					break;
+				}
+		sites[j++] = s;
+	}
+	site_count = j;
+	for (cell n = 1; n <= total; ++n) {	// Then the header and method hash are
+		cell m = method_slot(k,memory[h + 2*(total - n) + 2]);	// pointed at the
+		memory[h + 2*(total - n) + 3] = fresh[n] + delta;		// new code
+		if (method_hash[m].n == n) method_hash[m].addr = fresh[n] + delta;
+	}
+}
+
+cell recompile(cell k, unsigned char* from, unsigned char* to, cell* top) {
+	cell first = site_count, at, size;	// Compiles one chunk above all the existing
+	cell total = memory[chunks[k].header + 1];	// code, then moves it back into its old
+	cell last = k == objects;		// place if it fits there.  The last object
+	fresh = realloc(fresh,(total + 1) * sizeof(cell));	// is compiled where it is,
+	ident = chunks[k].name;			// unless others grew past it, and like a
+	note(1,"Recompiling object %s\n",dump());	// full build leaves its last cell open.
+	at = last && *top == chunks[k].end ? chunks[k].start : *top;
+	home = chunks[k].start ? 0 : at;
+	if (last) memset(&memory[chunks[k].start],0,(chunks[k].end - chunks[k].start) * sizeof(cell));
+	source = from;
+	source_end = to;
+	line = 0;
+	stale = 0;
+	rebuilding = latest = k;
+	visible = k - 1;
+	object = chunks[k].entry;
+	instr = at;
+	slot = 0;
+	compile();
+	if (!last) pad();
+	rebuilding = home = 0;
+	if (stale || visible != k || counts[k] != total) return 0;
+	if (!last && object != chunks[k+1].entry) return 0;
+	size = instr + (slot ? 1 : 0) - at;
+	if (!last) memset(&memory[chunks[k].start],0,(chunks[k].end - chunks[k].start) * sizeof(cell));
+	if (!last && size <= chunks[k].end - chunks[k].start) {
+		relocate(k,at,chunks[k].start,size,first);
+		return 1;
+	}
+	if (!chunks[k].start && at) return 0;	// (the code at address 0 can't move away)
+	relocate(k,at,at,size,first);
+	chunks[k].start = at;
+	chunks[k].end = *top = at + size;
+	return 1;
+}
+
+cell incremental(const char* image) {		// Recompiles only the objects whose source
+	unsigned char** origin;			// changed, and compiles any new objects after
+	unsigned char* extra;			// the rest.  Returns 0 if the image has to
+	cell* dirty;				// be built from scratch.
+	cell top, end_instr, end_slot, end_object, count = 0;
+	if ((fd = open(image,O_RDWR)) < 0 || !load_index(image)) return 0;
+	reload();
+	origin = calloc(objects + 2,sizeof(char*));
+	dirty = calloc(objects + 2,sizeof(cell));
+	if (!(extra = scan(origin,dirty))) return 0;
+	end_instr = instr;
+	end_slot = slot;
+	end_object = object;
+	top = instr + (slot ? 1 : 0);
+	for (cell k = 1; k <= objects; ++k) {
+		if (k == objects && extra != text + text_size && chunks[k].end != top)
+			dirty[k] = 1;		// new source carries on in the last object's open
+		if (!dirty[k]) continue;	// cell, so that has to be at the end of the code
+		if (chunks[k].fixed || !recompile(k,origin[k],k < objects ? origin[k+1] : extra,&top)) return 0;
+		if (k == objects) end_object = object;
+		++count;
+	}
+	if (!dirty[objects]) {			// Unless the last object was recompiled,
+		instr = top == end_instr + (end_slot ? 1 : 0) ? end_instr : top;	// we carry
+		slot = top == end_instr + (end_slot ? 1 : 0) ? end_slot : 0;	// on after it,
+	}					// or after any code that grew and moved.
+	object = end_object;
+	latest = visible = objects;
+	note(1,"Recompiled %d of %d objects\n",count,objects);
+	if (extra == text + text_size) return 1;
+	source = extra;				// Compile whatever follows, picking up the
+	source_end = text + text_size;		// last chunk's hash where the scan left it
+	chunk_hash = chunks[objects].hash;
+	line = 0;
+	compile();
+	close_chunk();
+	return 1;
+}
+
+void forget() {					// Forgets everything from a failed incremental
+	if (memory && memory != MAP_FAILED) munmap(memory,memory_size);	// build, so we can
+	if (fd != -1) close(fd);		// start over
+	memset(symbols,0,sizeof(symbols));
+	memset(string_hash,0,sizeof(string_hash));
+	memset(method_hash,0,sizeof(method_hash));
+	memset(counts,0,sizeof(counts));
+	memory = NULL;
+	fd = -1;
+	methods = objects = latest = visible = object = instr = slot = 0;
+	heading_count = site_count = 0;
+	lexicon = lexicon_end;
+	strings = strings_end;
+	chunk_hash = HASH_SEED;
+	source = text;
+	source_end = text + text_size;
+	line = 0;
 }
 
 void fini_memory() {
+	msync(memory,memory_size,MS_ASYNC);	// mark the image modified
 	munmap(memory,memory_size);	// save changes to the target image	
 	close(fd);			// and release the file
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// chunked images
+
+void pack(const char* image) {			// Rewrites the image as a header of the
+	char file[1024];			// magic, its size in cells and the number of
+	cell total = memory_size / sizeof(cell);	// chunks, an index of each chunk's
+	cell chunks = (total + CHUNK_CELLS - 1) / CHUNK_CELLS;	// offset and length in
+	cell offset = CHUNK_HEAD + 2 * chunks;	// cells, 0 for a chunk of zeros, and
+	cell head[CHUNK_HEAD] = { CHUNKED_MAGIC, total, chunks };	// the compressed
+	chunk_entry* index = calloc(chunks,sizeof(chunk_entry));	// chunks, which ns
+	cell* buffer = malloc((CHUNK_CELLS + 1) * sizeof(cell));	// pages in as used.
+	FILE* f;
+	snprintf(file,sizeof(file),"%s.tmp",image);
+	if (!index || !buffer) exit(6);
+	if (!(f = fopen(file,"w"))) {
+		fprintf(stderr,"Can not write %s\n",file);
+		exit(1);
+	}
+	fseek(f,offset * sizeof(cell),SEEK_SET);
+	for (cell n = 0; n < chunks; ++n) {
+		cell len = n + 1 < chunks ? CHUNK_CELLS : total - n * CHUNK_CELLS;
+		cell k = squeeze(&memory[n * CHUNK_CELLS],len,buffer);
+		if (k == 2 && buffer[0] == (0x80000000 | len) && !buffer[1]) continue;
+		index[n].offset = offset;
+		index[n].length = k;
+		fwrite(buffer,sizeof(cell),k,f);
+		offset += k;
+	}
+	rewind(f);
+	fwrite(head,sizeof(head),1,f);
+	fwrite(index,sizeof(chunk_entry),chunks,f);
+	if (ferror(f) | fclose(f) || rename(file,image)) exit(1);
+	note(1,"Packed %u cells into %u\n",total,offset);
+	free(index);
+	free(buffer);
+}
+
+void unpack(const char* image) {		// Expands a chunked image back into a flat
+	char file[1024];			// one, so it can be built incrementally
+	cell head[CHUNK_HEAD], *buffer, *flat;
+	chunk_entry* index;
+	int in = open(image,O_RDONLY), out;
+	if (in < 0 || read(in,head,sizeof(head)) != sizeof(head) || head[0] != CHUNKED_MAGIC) {
+		if (in >= 0) close(in);
+		return;
+	}
+	if (head[2] != (head[1] + CHUNK_CELLS - 1) / CHUNK_CELLS) exit(1);
+	index = malloc(head[2] * sizeof(chunk_entry));
+	buffer = malloc((CHUNK_CELLS + 1) * sizeof(cell));
+	if (!index || !buffer) exit(6);
+	snprintf(file,sizeof(file),"%s.tmp",image);
+	if ((out = open(file,O_CREAT|O_RDWR|O_TRUNC,0600)) < 0
+	|| ftruncate(out,(off_t)head[1] * sizeof(cell))) exit(1);
+	flat = mmap(NULL,(size_t)head[1] * sizeof(cell),PROT_READ|PROT_WRITE,MAP_SHARED|MAP_FILE,out,0);
+	if (flat == MAP_FAILED) exit(2);
+	if (read(in,index,head[2] * sizeof(chunk_entry)) != head[2] * sizeof(chunk_entry)) exit(1);
+	for (cell n = 0; n < head[2]; ++n) {
+		cell len = n + 1 < head[2] ? CHUNK_CELLS : head[1] - n * CHUNK_CELLS;
+		cell k = index[n].length;
+		if (!k) continue;		// chunks of zeros stay sparse
+		if (k > CHUNK_CELLS + 1 || pread(in,buffer,k * sizeof(cell),(off_t)index[n].offset * sizeof(cell)) != k * sizeof(cell))
+			exit(1);
+		if (!expand(buffer,k,&flat[n * CHUNK_CELLS],len)) exit(1);
+	}
+	munmap(flat,(size_t)head[1] * sizeof(cell));
+	close(out);
+	close(in);
+	if (rename(file,image)) exit(1);
+	free(index);
+	free(buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// parallel builds
+
+int compare_names(const void* a, const void* b) {
+	const name* x = a;
+	const name* y = b;
+	int d = memcmp(x->word,y->word,sizeof(x->word));
+	return d ? d : (x->source > y->source) - (x->source < y->source);
+}
+
+void scan_names() {				// Finds the words that begin objects or define
+	cell count = source_count;		// methods in each source, by the same rules
+	opens = calloc(count + 2,sizeof(cell));	// as compile(), skipping the rest of every
+	for (cell n = 0; n < count; ++n) {	// line two tabs in, and notes which
+		source_index = n;		// sources begin with an object's name
+		source_count = n + 1;
+		cell seen = line = 0, defined = 0;	// and define a method before any
+		while (word()) {		// code, which would otherwise share the last
+			if (line < 2 && (input_index || input_slot)) {	// cell of the source
+				if (!seen) seen = !line && *word_start >= 'A' && *word_start <= 'Z' ? 1 : 2;
+				if (line) defined = 1;	// before (seen is 1 once we see a
+				names = grow(names,&name_size,name_count + 1,sizeof(name));
+				memcpy(names[name_count].word,input,sizeof(input));
+				names[name_count].depth = line;
+				names[name_count++].source = n + 1;
+			} else if (line > 1 && key != 0x60) {
+				unsigned char* p = memchr(source,'\n',source_end - source);
+				if (!defined && (source == source_end || *source != '\t'))
+					seen = 2;	// capitalized name, 2 if anything
+							// else comes first; three tabs in
+							// is only a comment)
+				source = p ? p : source_end;
+			}
+			if (key == 0x60) line = 0;
+		}
+		opens[n + 1] = !n || (seen == 1 && defined);
+	}
+	source_index = 0;
+	source_count = count;
+	qsort(names,name_count,sizeof(name),compare_names);
+}
+
+void unit_file(char* file, const char* image, cell n) {
+	snprintf(file,1024,"%s.%d.unit",image,n);
+}
+
+void read_unit(cell n, cell count, cell last) {	// Reads the sources of the unit
+	sources += n - 1;			// beginning with the nth.  Only the last
+	source_count = count;			// unit's last word can run into the end of
+	source_index = text_size = 0;		// the file, just as when the sources are
+	load_text();				// read one after another.
+	sources -= n - 1;
+	if (!last) {
+		if (!(text = realloc(text,text_size + 1))) exit(6);
+		text[text_size++] = '\n';
+	}
+	source = text;
+	source_end = text + text_size;
+}
+
+void compile_unit(const char* image, cell n, cell count, cell last) {	// Compiles the nth
+	char file[1024];			// source, and any after it that carry on its
+	cell start = n > 1;			// last object, into a unit the link step can
+	FILE* f;				// put anywhere.  Its code starts at 1, as a
+	memory = mmap(NULL,memory_size,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+	if (memory == MAP_FAILED) exit(2);	// method at 0 could never be called, and
+	unit = n;				// only the last unit's code ends in an open
+	read_unit(n,count,last);		// cell.
+	init_strings();
+	init_lexicon();
+	if (start) object = EXTERNAL;
+	instr = start;
+	compile();
+	if (!last) pad();
+	cell head[12] = { tangled ? SERIAL_MAGIC : UNIT_MAGIC, strings, start, instr, slot,
+		lexicon, object, objects, site_count, ref_count, cells, plain_cells };
+	unit_file(file,image,n);
+	if (!(f = fopen(file,"w"))) {
+		fprintf(stderr,"Can not write %s\n",file);
+		exit(7);
+	}
+	fwrite(head,sizeof(head),1,f);
+	fwrite(&memory[strings],sizeof(cell),strings_end - strings,f);
+	fwrite(&memory[start],sizeof(cell),instr + (slot ? 1 : 0) - start,f);
+	fwrite(&memory[lexicon],sizeof(cell),lexicon_end - lexicon,f);
+	fwrite(sites,sizeof(site),site_count,f);
+	fwrite(refs,sizeof(ref),ref_count,f);
+	if (ferror(f) | fclose(f)) exit(7);
+}
+
+void declare(cell name) {			// Begins an object in the image being linked
+	memory[--lexicon] = 0;
+	memory[--lexicon] = name;
+	ident = name;
+	open_chunk(++objects);
+	symbols[symbol(name)].object = latest = visible = objects;
+}
+
+void attach(cell name, cell addr) {		// and adds a method to the newest one
+	lexicon -= 2;
+	memory[lexicon] = memory[lexicon+2];
+	memory[lexicon+1] = memory[lexicon+3]+1;
+	memory[lexicon+2] = name;
+	memory[lexicon+3] = addr;
+	add_method(latest,name,addr);
+}
+
+void patch(cell at, cell op) {			// Fills the open slot after a ref's cell
+	memory[at] = (memory[at] & ~0xff) | op;
+}
+
+cell next_unit(cell n) {			// Finds the first source of the unit after
+	while (++n <= source_count && !opens[n]);	// the one source n begins
+	return n;
+}
+
+void compile_serial(cell n, cell* context) {
+	cell count = source_count, k = next_unit(n);
+	read_unit(n,k - n,k > count);
+	line = 0;
+	object = *context;
+	visible = objects;
+	compile();
+	if (k <= count) pad();
+	source_count = count;
+	*context = object;
+}
+
+void link_unit(const char* image, cell n, cell* context) {
+	char file[1024];			// Adds the nth unit to the image.  Its strings
+	struct stat st;				// are merged with those already there, its
+	cell *u, *str, *code, *lex, *map, *objmap, *blocks;	// code placed after theirs and
+	site* calls;				// its calls repointed, its objects and methods
+	ref* r;					// added to the lexicon, and then its refs are
+	cell count, size, words, delta, b = 0;	// resolved in order, just as
+	int in;					// compile() would have.
+	unit_file(file,image,n);
+	if ((in = open(file,O_RDONLY)) < 0 || fstat(in,&st) || !(u = malloc(st.st_size + 1))
+	|| read(in,u,st.st_size) != st.st_size || (u[0] != UNIT_MAGIC && u[0] != SERIAL_MAGIC)) {
+		fprintf(stderr,"Can not read %s\n",file);
+		exit(7);
+	}
+	close(in);
+	if (u[0] == SERIAL_MAGIC || (u[2] && !instr && !slot)) {	// A unit its worker
+		free(u);			// couldn't settle, or one that would start
+		compile_serial(n,context);	// at address 0 after all, is compiled here
+		return;				// instead, picking up where the units
+	}					// before it left off
+	count = (strings_end - u[1]) / 4;
+	size = u[3] + (u[4] ? 1 : 0) - u[2];
+	words = lexicon_end - u[5];
+	str = u + 12;
+	code = str + 4*count;
+	lex = code + size;
+	calls = (site*)(lex + words);
+	r = (ref*)(calls + u[8]);
+	map = malloc((count + 1) * sizeof(cell));
+	objmap = malloc((u[7] + 1) * sizeof(cell));
+	blocks = malloc((u[7] + 1) * sizeof(cell));
+	if (!map || !objmap || !blocks) exit(6);
+	for (cell i = 0; i < count; ++i) {	// oldest string first
+		memcpy(input,&str[4*(count - i - 1)],sizeof(input));
+		input_index = 4;
+		map[i] = string();
+	}
+	delta = instr - u[2];
+	memcpy(&memory[instr],code,size * sizeof(cell));
+	for (cell i = 0; i < u[8]; ++i)
+		memory[calls[i].addr + delta] += delta;
+	for (cell i = 0; i < words; i += 2*lex[i+1] + 2)	// newest object first
+		blocks[b++] = i;
+	objmap[1] = 1;				// Methods defined before the first unit's
+	for (cell j = 1; j <= u[7]; ++j) {	// first object belong to Core
+		cell* h = &lex[blocks[u[7] - j]];
+		cell total = j == 1 ? h[1] - OPCODES : h[1];
+		if (j > 1) declare(map[symbol(h[0])]);
+		objmap[j] = latest;
+		for (cell m = total; m; --m)	// oldest method first
+			attach(map[symbol(h[2*m])],h[2*m + 1] + delta);
+	}
+	for (cell i = 0; i < u[9]; ++i, ++r) {
+		cell at = r->addr + delta, g = objmap[r->latest], saved = counts[g], addr;
+		if (r->context != EXTERNAL) *context = objmap[r->context];
+		counts[g] = r->count;
+		object = *context;
+		ident = map[symbol(r->ident)];
+		number = r->number;
+		visible = objmap[r->visible];
+		if ((addr = method())) {	// a call,
+			memory[at] = addr;
+			patch(at + 1,0x81);
+		} else if (find()) {		// an object, which leaves nops
+			memory[at] = 0x80808080;
+			*context = object;
+		} else {			// or a literal
+			memory[at] = number & 0x80000000 ? -number & 0x7fffffff : number & 0x7fffffff;
+			if (number & 0x80000000) patch(at + 1,0x95);
+		}
+		counts[g] = saved;
+	}
+	if (u[6] != EXTERNAL) *context = objmap[u[6]];
+	object = *context;
+	visible = objects;
+	instr = u[3] + delta;
+	slot = u[4];
+	cells += u[10];
+	plain_cells += u[11];
+	free(u);
+	free(map);
+	free(objmap);
+	free(blocks);
+}
+
+void build(const char* image) {		// Compiles each unit in a worker of its own,
+	char file[1024];			// up to jobs at a time, and links them in
+	cell n = 1, k, running = 0, context;	// order
+	int status, failed = 0;
+	pid_t pid;
+	scan_names();
+	while (n <= source_count || running) {
+		if (n <= source_count && running < jobs) {
+			k = next_unit(n);
+			if ((pid = fork()) < 0) exit(7);
+			if (!pid) {
+				compile_unit(image,n,k - n,k > source_count);
+				exit(0);
+			}
+			++running;
+			n = k;
+			continue;
+		}
+		if (wait(&status) < 0) break;
+		--running;
+		if (!WIFEXITED(status)) failed = 7;
+		else if (WEXITSTATUS(status)) failed = WEXITSTATUS(status);
+	}
+	if (!failed) {
+		init_memory(image);
+		init_strings();
+		init_lexicon();
+		context = object;
+		for (n = 1; n <= source_count; n = next_unit(n)) link_unit(image,n,&context);
+	}
+	for (n = 1; n <= source_count; ++n) {
+		unit_file(file,image,n);
+		unlink(file);
+	}
+	if (failed) exit(failed);
+}
+
 int main(int argc, char** argv) {
-	if (argc != 2) {		// Ensure that the user supplies a image filename
-		fprintf(stderr,"Usage: %s image.nsi\n",argv[0]);
+	int c, update = 0;
+	while ((c = getopt(argc,argv,"iOzj:v:s:")) != -1) switch(c) {
+		case 'i': update = 1; break;			// -i rebuilds incrementally
+		case 'O': optimize = 1; break;			// -O optimizes the code
+		case 'z': packing = 1; break;			// -z writes a chunked image
+		case 'j': jobs = atoi(optarg) > 0 ? atoi(optarg) : sysconf(_SC_NPROCESSORS_ONLN);	// -j
+			break;					// compiles sources in parallel
+		case 'v': verbose = atoi(optarg); break;	// -v sets the diagnostics level
+		case 's': memory_size = (size_t)atoi(optarg) << 20; break;	// -s image size in MB
+		default: memory_size = 0;
+	}
+	if (optind >= argc || memory_size < IMAGE_SIZE || memory_size > (size_t)MAX_IMAGE_MB << 20) {
+		fprintf(stderr,"Usage: %s [-i] [-O] [-z] [-j jobs] [-v level] [-s megabytes] image.nsi [source.ns...]\n",argv[0]);
 		return 1;		// Return error and usage message if no file supplied
 	}
-	init_memory(argv[1]);		// create a new memory image of the suppied filename
-	init_strings();			// setup of core system strings, and opcode tables
-	init_lexicon();			// define a basic lexicon
-	compile();			// compile the source listings from stdin
+	sources = argv + optind + 1;	// compile the named sources, or stdin if none
+	source_count = argc - optind - 1;
+	init_keys();			// build the character translation table
+	init_constants();		// and the constants the optimizer can build from ops
+	if (update) load_text();	// read all the source, to compare with the last build
+	if (update) image_stamp(argv[optind],found);	// note the image the index must match
+	if (update) unpack(argv[optind]);	// and expand the image if it was chunked
+	if (jobs && source_count > 1 && !update) build(argv[optind]);	// compile the sources apart
+	else if (!update || !incremental(argv[optind])) {
+		if (update) forget();	// start over if the last build can't be updated
+		init_memory(argv[optind]);	// create a new memory image of the suppied filename
+		init_strings();		// setup of core system strings, and opcode tables
+		init_lexicon();		// define a basic lexicon
+		compile();		// compile the source listings
+		close_chunk();
+	}
+	if (!update) drop_index(argv[optind]);	// drop the index of the old image
+	if (optimize) note(1,"Code: %u cells, %u before optimizing\n",cells,plain_cells);
+	if (packing) pack(argv[optind]);	// chunk and compress the image
 	fini_memory();			// save the memory image and close the file
+	if (update) save_index(argv[optind]);	// and index its chunks for the next build
 	return 0;			// return success
 }
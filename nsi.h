@@ -0,0 +1,77 @@
+////////////////////////////////////////////////////////////////////////////////
+// nsi.h
+//
+// The NewScript image format, shared by nsc which writes images and ns which
+// runs them.  Include it after the cell typedef.
+//
+// Copyright 2009 David J. Goehrig  <dave@nexttolast.com>
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef NSI_H
+#define NSI_H
+
+////////////////////////////////////////////////////////////////////////////////
+// layout
+#define STRINGS_OFFSET	2097152		// Top of the strings table, which grows down to
+#define LEXICON_OFFSET	2017152		// the top of the lexicon, which grows down too
+
+////////////////////////////////////////////////////////////////////////////////
+// chunked images
+#define CHUNKED_MAGIC	0x5a49534e	// "NSIZ", first cell of a chunked image
+#define CHUNK_CELLS	16384		// Cells in each chunk of a chunked image, 64kB
+#define CHUNK_HEAD	3		// Cells in the header, before the index
+
+typedef struct {	// A chunked image is a header of the magic, the image size in
+	cell offset;	// cells and the number of chunks, then an index giving the offset
+	cell length;	// and length in cells of each compressed chunk, 0 for a chunk of
+} chunk_entry;		// zeros, and then the chunks.
+
+static cell squeeze(cell* in, cell n, cell* out) {	// Compress cells as runs of 3 or
+	cell i = 0, o = 0, start;		// more equal cells, a count with the top bit
+	while (i < n) {				// set and the value, and the literal cells
+		cell r = 1;			// between them, a count followed by the
+		while (i + r < n && in[i + r] == in[i]) ++r;	// cells.  Output is never
+		if (r >= 3) {			// more than a cell longer than the input.
+			out[o++] = 0x80000000 | r;
+			out[o++] = in[i];
+			i += r;
+			continue;
+		}
+		start = o++;
+		while (i < n && !(i + 2 < n && in[i] == in[i+1] && in[i] == in[i+2])) out[o++] = in[i++];
+		out[start] = o - start - 1;
+	}
+	return o;
+}
+
+static cell expand(cell* in, cell len, cell* out, cell n) {	// Expand a compressed
+	cell i = 0, o = 0;				// chunk, returns 0 if it is
+	while (i < len) {				// corrupt
+		cell t = in[i++], k = t & 0x7fffffff;
+		if (o + k > n || i + (t & 0x80000000 ? 1 : k) > len) return 0;
+		if (t & 0x80000000) {
+			for (cell j = 0; j < k; ++j) out[o + j] = in[i];
+			++i;
+		} else {
+			memcpy(out + o,in + i,k * sizeof(cell));
+			i += k;
+		}
+		o += k;
+	}
+	return o == n;
+}
+
+#endif